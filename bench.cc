@@ -0,0 +1,253 @@
+extern "C" {
+#include <cairo/cairo.h>
+#include <pango/pangocairo.h>
+#include <glib-object.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+}
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "menu.h"
+#include "config.h"
+#include "raster_pool.h"
+
+// Headless benchmark of everything between the input and a finished panel
+// raster: parse, measure, opening submenus, and painting full and hover
+// frames into offscreen image surfaces, full frames also on the raster
+// pool. No compositor is involved.
+
+// Every allocation in the process comes through here, so a phase's count
+// includes what pango, cairo and glib allocate on its behalf
+static std::atomic<size_t> allocations;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+void *calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+void *realloc(void *ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Timings and allocation counts of every run of one phase
+struct Phase {
+    const char *name;
+    std::vector<double> ms;
+    std::vector<size_t> allocs;
+
+    double percentile(int p) {
+        if (ms.empty()) return 0;
+        std::sort(ms.begin(), ms.end());
+        return ms[std::min(ms.size() - 1, ms.size() * p / 100)];
+    }
+    double mean_allocs() const {
+        size_t total = 0;
+        for (size_t a : allocs) total += a;
+        return allocs.empty() ? 0 : (double)total / allocs.size();
+    }
+};
+
+// Run `work` as one run of a phase
+template <typename Work>
+static void timed(Phase& phase, Work work) {
+    size_t start_allocs = allocations;
+    double start = now_ms();
+    work();
+    phase.ms.push_back(now_ms() - start);
+    phase.allocs.push_back(allocations - start_allocs);
+}
+
+struct BenchOptions {
+    int breadth = 12;
+    int depth = 3;
+    int iterations = 50;
+    double scale = 1;
+    size_t threads = RasterPool::default_threads();
+    bool json = false;
+};
+
+// A menu where every item above the deepest level has a submenu of
+// `breadth` items, with labels of mixed length and, where they are
+// allowed, at the top level, a separator now and then
+static void write_synthetic_menu(std::string& out, int breadth, int depth, int level,
+                                 const std::string& prefix) {
+    for (int i = 0; i < breadth; ++i) {
+        std::string name = prefix + std::to_string(i + 1);
+        out.append(level, '\t');
+        out += "Item " + name;
+        if (i % 3 == 1) out += " with a somewhat longer label";
+        out += "\tout-" + name + "\n";
+        if (level + 1 < depth)
+            write_synthetic_menu(out, breadth, depth, level + 1, name + ".");
+        if (level == 0 && i % 5 == 4 && i + 1 < breadth)
+            out += "\n";
+    }
+}
+
+// The input as a file, which is how parse_menu likes it best: mapped
+static int synthetic_menu_fd(const BenchOptions& opt) {
+    std::string text;
+    write_synthetic_menu(text, opt.breadth, opt.depth, 0, "");
+    int fd = memfd_create("rmenu-bench", MFD_CLOEXEC);
+    if (fd < 0 || write(fd, text.data(), text.size()) != (ssize_t)text.size()) {
+        perror("rmenu-bench: menu file");
+        exit(1);
+    }
+    return fd;
+}
+
+static void parse_options(int argc, char **argv, BenchOptions& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (strcmp(arg, "--json") == 0) {
+            opt.json = true;
+            continue;
+        }
+        if (!value) {
+            fprintf(stderr, "rmenu-bench: %s needs a value\n", arg);
+            exit(2);
+        }
+        if (strcmp(arg, "--breadth") == 0) opt.breadth = std::max(1, atoi(value));
+        else if (strcmp(arg, "--depth") == 0) opt.depth = std::max(1, atoi(value));
+        else if (strcmp(arg, "--iterations") == 0) opt.iterations = std::max(1, atoi(value));
+        else if (strcmp(arg, "--scale") == 0) opt.scale = atof(value) > 0 ? atof(value) : 1;
+        else if (strcmp(arg, "--threads") == 0) opt.threads = std::max(0, atoi(value));
+        else {
+            fprintf(stderr, "usage: rmenu-bench [--breadth N] [--depth N] [--iterations N] "
+                            "[--scale S] [--threads N] [--json]\n");
+            exit(2);
+        }
+        ++i;
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opt;
+    parse_options(argc, argv, opt);
+    int fd = synthetic_menu_fd(opt);
+
+    // Shaped like the menu's own context, scaled the same way
+    PangoFontMap *font_map = pango_cairo_font_map_new();
+    PangoContext *pango = pango_font_map_create_context(font_map);
+    scale_pango_context(pango, opt.scale);
+    PangoFontDescription *desc = pango_font_description_from_string(font);
+
+    Phase parse = { "parse", {}, {} };
+    Phase measure = { "measure", {}, {} };
+    Phase opening = { "open", {}, {} };
+    Phase render = { "render", {}, {} };
+    Phase parallel = { "render-mt", {}, {} };
+    Phase hover = { "hover", {}, {} };
+    RasterPool pool(opt.threads);
+    size_t items = 0, level_items = 1;
+    for (int level = 0; level < opt.depth; ++level) {
+        level_items *= opt.breadth;
+        items += level_items;
+    }
+    size_t frames = 0;
+
+    // The first run loads fonts and fills fontconfig's caches; it is not
+    // what a warm menu costs, so it is left out
+    for (int iter = -1; iter < opt.iterations; ++iter) {
+        bool counted = iter >= 0;
+        Phase scratch = { "warm-up", {}, {} };
+        lseek(fd, 0, SEEK_SET);
+        Menu menu;
+
+        timed(counted ? parse : scratch, [&] { parse_menu(menu, fd); });
+        if (menu.error || menu.empty()) {
+            fprintf(stderr, "rmenu-bench: %s\n", menu.error ? menu.error : "empty menu");
+            return 1;
+        }
+        timed(counted ? measure : scratch, [&] { measure_menu(menu, pango, desc); });
+
+        // Open the first submenu at every level, as a pointer walking
+        // straight down would
+        std::vector<int> open_panels(1, 0);
+        timed(counted ? opening : scratch, [&] {
+            while (true) {
+                const MenuPanel& panel = menu.panels[open_panels.back()];
+                int32_t id = panel.count ? menu.item(panel, 0) : -1;
+                if (id < 0 || !menu.has_submenu(id)) break;
+                open_panels.push_back(open_submenu(menu, id, pango, desc));
+            }
+        });
+
+        // A full frame rasterizes every open panel from scratch, one after
+        // another, and then again side by side on the pool
+        std::vector<RasterJob> jobs;
+        for (size_t level = 0; level < open_panels.size(); ++level)
+            jobs.push_back({ open_panels[level], level + 1 < open_panels.size() ? 0 : -1 });
+        timed(counted ? render : scratch, [&] {
+            for (const RasterJob& job : jobs)
+                update_panel_raster(menu, menu.panels[job.panel], job.hovered, opt.scale);
+        });
+        for (int p : open_panels) {
+            cairo_surface_destroy(menu.panels[p].raster);
+            menu.panels[p].raster = nullptr;
+        }
+        timed(counted ? parallel : scratch, [&] { pool.update(menu, jobs, opt.scale, desc); });
+
+        // Hover frames move the lit item down the deepest panel, which only
+        // repaints the two buttons that changed
+        MenuPanel& deepest = menu.panels[open_panels.back()];
+        for (size_t pos = 0; pos < deepest.count; ++pos) {
+            if (menu.separator[menu.item(deepest, pos)]) continue;
+            timed(counted ? hover : scratch, [&] { update_panel_raster(menu, deepest, pos, opt.scale); });
+            if (counted) frames++;
+        }
+
+        free_menu(menu);
+    }
+
+    Phase *phases[] = { &parse, &measure, &opening, &render, &parallel, &hover };
+    if (opt.json) {
+        printf("{\"breadth\": %d, \"depth\": %d, \"items\": %zu, \"iterations\": %d, "
+               "\"scale\": %g, \"threads\": %zu, \"hover_frames\": %zu, \"phases\": {",
+               opt.breadth, opt.depth, items, opt.iterations, opt.scale, opt.threads, frames);
+        for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+            Phase& p = *phases[i];
+            printf("%s\"%s\": {\"p50_ms\": %.4f, \"p99_ms\": %.4f, \"allocs\": %.1f}",
+                   i ? ", " : "", p.name, p.percentile(50), p.percentile(99), p.mean_allocs());
+        }
+        printf("}}\n");
+    } else {
+        printf("%zu items, breadth %d, depth %d, scale %g, %d iterations, %zu raster threads\n",
+               items, opt.breadth, opt.depth, opt.scale, opt.iterations, opt.threads);
+        printf("%-10s %10s %10s %12s\n", "phase", "p50 ms", "p99 ms", "allocs/run");
+        for (Phase *p : phases) {
+            printf("%-10s %10.4f %10.4f %12.1f\n", p->name, p->percentile(50), p->percentile(99),
+                   p->mean_allocs());
+        }
+    }
+
+    pango_font_description_free(desc);
+    g_object_unref(pango);
+    g_object_unref(font_map);
+    close(fd);
+    return 0;
+}
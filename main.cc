@@ -9,16 +9,37 @@ extern "C" {
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <malloc.h>
 #define namespace namespace_
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #undef namespace
+#include "viewporter-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include <xkbcommon/xkbcommon.h>
 }
 
 #include <vector>
-#include <string>
+#include <memory>
 #include <map>
-#include <functional>
+#include <algorithm>
+#include <thread>
+#include "menu.h"
 #include "config.h"
+#include "trace.h"
+#include "raster_pool.h"
+#ifdef RMENU_REPLAY
+#include "replay.h"
+#endif
 
 #ifndef BTN_LEFT
 #define BTN_LEFT 0x110
@@ -26,20 +47,91 @@ extern "C" {
 
 class wl_state;
 
-struct MenuList {
-    std::vector<class MenuItem> items;
-    int last_rendered = 0;
-
-    MenuItem& operator[](size_t i) { return items[i]; }
-    const MenuItem& operator[](size_t i) const { return items[i]; }
-    size_t size() const { return items.size(); }
-    bool empty() const { return items.empty(); }
-    auto begin() { return items.begin(); }
-    auto end() { return items.end(); }
-    auto begin() const { return items.begin(); }
-    auto end() const { return items.end(); }
-    auto cbegin() const { return items.cbegin(); }
-    auto cend() const { return items.cend(); }
+// Indices from the root menu down to one item. Storage is sized to the
+// depth of the menu read so far, so filling, comparing and copying paths on
+// the pointer hot path never touches the heap.
+class MenuPath {
+  public:
+    void reserve(size_t depth) {
+        if (depth <= cap) return;
+        int *grown = new int[depth];
+        std::copy(storage.get(), storage.get() + len, grown);
+        storage.reset(grown);
+        cap = depth;
+    }
+    void assign(const MenuPath& other) {
+        len = std::min(other.len, cap);
+        std::copy(other.storage.get(), other.storage.get() + len, storage.get());
+    }
+    void push_back(int idx) { if (len < cap) storage[len++] = idx; }
+    void truncate(size_t n) { len = std::min(n, len); }
+    void clear() { len = 0; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    int operator[](size_t i) const { return storage[i]; }
+    int back() const { return storage[len - 1]; }
+    bool operator==(const MenuPath& other) const {
+        return len == other.len && std::equal(storage.get(), storage.get() + len, other.storage.get());
+    }
+    bool operator!=(const MenuPath& other) const { return !(*this == other); }
+
+  private:
+    std::unique_ptr<int[]> storage;
+    size_t cap = 0;
+    size_t len = 0;
+};
+
+// One slot of the shm pool. A slot is busy from the moment it is attached
+// until the compositor sends wl_buffer.release for it.
+struct ShmBuffer {
+    struct wl_buffer *buffer = nullptr;
+    size_t offset = 0;
+    size_t capacity = 0;
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    bool busy = false;
+    // Areas that changed since this slot last held the current frame
+    std::vector<Rect> damage;
+    bool full_damage = true;
+};
+
+// Long-lived shared memory backing all menu buffers. The mapping only grows,
+// and only when a frame needs more room than the free slots already have.
+struct ShmPool {
+    static const int max_slots = 3;
+    int fd = -1;
+    void *data = nullptr;
+    size_t size = 0;
+    size_t used = 0;
+    struct wl_shm_pool *pool = nullptr;
+    ShmBuffer slots[max_slots];
+};
+
+// A menu panel that is visible in a frame, and which of its items is lit.
+// The panels of the last committed frame double as the hit-test index.
+struct OpenPanel {
+    int panel;
+    int hovered;
+    Rect bounds;
+    bool contains(int px, int py) const {
+        return px >= bounds.x && px <= bounds.x + bounds.w &&
+               py >= bounds.y && py <= bounds.y + bounds.h;
+    }
+};
+
+// Each open menu level is shown on its own surface, sized to exactly the
+// panel open at that level: the root menu on the layer surface, deeper
+// levels on wl_subsurfaces of it. `shown` is what the last commit put there.
+struct PanelSurface {
+    struct wl_surface *surface = nullptr;
+    struct wl_subsurface *subsurface = nullptr;
+    struct wp_viewport *viewport = nullptr; // with fractional scaling
+    ShmPool pool;
+    OpenPanel shown = {-1, -1, {}};
+    bool mapped = false;
+    bool stale = false; // the panel shown was re-measured since
+    ShmBuffer *next = nullptr; // claimed for the frame being drawn
 };
 
 struct wl_output_data {
@@ -53,60 +145,109 @@ class wl_state {
     struct wl_display *display;
     struct wl_registry *registry;
     struct wl_compositor *compositor;
+    struct wl_subcompositor *subcompositor;
     struct wl_shm *shm;
     struct zwlr_layer_shell_v1 *layer_shell;
+    struct wp_viewporter *viewporter = nullptr;
+    struct wp_single_pixel_buffer_manager_v1 *single_pixel = nullptr;
+    struct wp_fractional_scale_manager_v1 *fractional_scale_manager = nullptr;
     struct wl_surface *surface;
     struct zwlr_layer_surface_v1 *layer_surface;
-    struct wl_buffer *buffer;
+    std::vector<PanelSurface> panel_surfaces;
+    // Set when the menu changed and a frame is owed; paced by frame callbacks
+    bool redraw_pending = false;
+    struct wl_callback *frame_callback = nullptr;
 
-    MenuList menu;
+    Menu menu;
+    int32_t selected = -1; // item picked by the user, printed once the menu is gone
     bool running;
+    bool configured = false;
     int width;
     int height;
-    int current_frame = 0;
 
     // For click-away background layer
     struct wl_surface *bg_surface = nullptr;
     struct zwlr_layer_surface_v1 *bg_layer_surface = nullptr;
     struct wl_buffer *bg_buffer = nullptr;
+    struct wp_viewport *bg_viewport = nullptr;
+    uint32_t bg_width = 0;
+    uint32_t bg_height = 0;
     struct wl_pointer *bg_pointer = nullptr;
 
-    // HiDPI related
+    // HiDPI related. With fractional scaling the compositor tells the menu
+    // surface its preferred scale, in 120ths; otherwise the output's integer
+    // scale is used.
     std::map<uint32_t, wl_output_data> outputs_by_name;
     struct wl_output *chosen_output;
-    int chosen_scale;
+    double chosen_scale;
+    struct wp_fractional_scale_v1 *fractional_scale = nullptr;
+    uint32_t preferred_scale = 0;
 
     // Pointer/seat
     struct wl_seat *seat = nullptr;
     struct wl_pointer *pointer = nullptr;
     int pointer_x = 0; // in logical coords
     int pointer_y = 0; // in logical coords
+    int pointer_dy = 1; // direction of the last vertical motion
+    size_t pointer_level = 0; // panel surface the pointer is over
     bool pointer_inside = false;
-
-    // Hover handling
-    std::vector<int> hovered_path;
-
-    std::vector<int> find_hovered_path();
-    std::vector<int> find_submenu_path();
-    bool handle_menu_click(MenuList& menu_list);
-};
-
-class MenuItem {
-  public:
-    std::string label;
-    std::string output;
-    MenuList submenu;
-    wl_state* state;
-    int last_rendered = 0;
-    int x = 0, y = 0, w = 0, h = 0;
-    bool is_separator = false;
-    int max_x() const { return x+w; }
-    int max_y() const { return y+h; }
-    bool in_x(int px) const { return px >= x && px <= max_x(); }
-    bool in_y(int py) const { return py >= y && py <= max_y(); }
-    bool in_box() const { return !is_separator &&
-      last_rendered == state->current_frame &&
-      in_x(state->pointer_x) && in_y(state->pointer_y); }
+    bool pointer_entered = false;
+    bool pointer_moved = false;
+    double pointer_scroll = 0; // vertical axis motion within this pointer frame
+
+    // Largest the panel pools have been together, for --stats
+    size_t shm_peak = 0;
+
+    // With --record, pointer events are written here, timed from trace_start
+    FILE *trace = nullptr;
+    double trace_start = 0;
+
+    // Hover handling; hit_path is scratch space for the hit-test
+    MenuPath hovered_path;
+    MenuPath hit_path;
+
+    // Keyboard focus is the last item of hovered_path. Typing filters the
+    // panel it is in, found at filter_level, or with Tab the whole tree.
+    struct wl_keyboard *keyboard = nullptr;
+    struct xkb_context *xkb = nullptr;
+    struct xkb_keymap *keymap = nullptr;
+    struct xkb_state *key_state = nullptr;
+    bool filter_tree = false;
+    size_t filter_level = 0;
+
+    // Damage tracking: what the last committed frame showed, and scratch
+    // space for the panel-local rects the frame being drawn has to repaint
+    std::vector<OpenPanel> drawn_panels;
+    std::vector<OpenPanel> open_panels;
+    std::vector<Rect> frame_damage;
+    std::vector<Rect> repaint;
+    // Panels a frame draws from scratch, drawn side by side when there are
+    // several. The pool is only started the first time that happens.
+    std::vector<RasterJob> raster_jobs;
+    std::unique_ptr<RasterPool> raster_pool;
+    std::unique_ptr<RasterAhead> raster_ahead; // for hover intent
+    // Panels that may hold a raster, so that those closed since can let go
+    std::vector<int> raster_panels;
+    size_t rasterized_bytes = 0; // raster drawn in all, for rmenu-replay
+
+    // Retained text layouts; rebuilt only when scale or font changes. Until
+    // text_ready they belong to the startup thread that warms them up.
+    bool text_ready = false;
+    PangoFontMap *font_map = nullptr;
+    PangoContext *pango = nullptr;
+    LabelCache label_cache;
+    const PangoFontDescription *layout_desc = nullptr;
+    double layout_scale = 0;
+
+    void find_hovered_path(MenuPath& path);
+    bool handle_menu_click();
+    int panel_at(size_t level);
+    size_t focus_level();
+    void focus_item(size_t level, int pos);
+    void hover_item(int32_t id);
+    void clear_filter();
+    void filter(std::string query);
+    void handle_key(xkb_keysym_t sym, const char *text);
 };
 
 PangoFontDescription *desc;
@@ -117,7 +258,10 @@ static void output_done(void*, struct wl_output*) {}
 static void output_name(void*, struct wl_output*, const char*) {}
 static void output_description(void*, struct wl_output*, const char*) {}
 
-static struct wl_buffer *create_buffer(wl_state *state);
+static void redraw(wl_state *state);
+static void schedule_redraw(wl_state *state);
+static void release_closed_rasters(wl_state *state);
+static void attach_bg_buffer(wl_state *state, uint32_t width, uint32_t height);
 
 static void output_scale(void *data, struct wl_output *output, int32_t factor) {
     wl_state* state = (wl_state*)data;
@@ -139,212 +283,230 @@ static const struct wl_output_listener output_listener = {
 #endif
 };
 
-struct RenderedMenuGeometry {
-    int width;
-    int height;
-};
-
-std::tuple<int,int,int,int> menu_geometry(const MenuList& submenu) {
-  if (submenu.empty()) {
-    return {0,0,0,0};
-  }
-  return {submenu[0].x, submenu[0].y, submenu[submenu.size()-1].max_x(), submenu[submenu.size()-1].max_y()};
+// Only the panels drawn in the last frame can be under the pointer. Check
+// their bounds from the root down, then search within the one that matches.
+void wl_state::find_hovered_path(MenuPath& path) {
+    path.clear();
+    for (size_t level = 0; level < drawn_panels.size(); ++level) {
+        const OpenPanel& panel = drawn_panels[level];
+        if (!panel.contains(pointer_x, pointer_y)) continue;
+        int idx = item_at(menu, menu.panels[panel.panel], pointer_x, pointer_y);
+        if (idx < 0) continue;
+        for (size_t l = 0; l < level; ++l)
+            path.push_back(drawn_panels[l].hovered);
+        path.push_back(idx);
+        break;
+    }
 }
 
-std::vector<int> wl_state::find_submenu_path() {
-    std::vector<int> path;
-    const MenuList* current = &menu;
-    while (true) {
-        bool found = false;
-        for (size_t i = 0; i < current->size(); ++i) {
-            const auto& item = (*current)[i];
-            if (!item.submenu.empty() && current_frame == item.submenu.last_rendered) {
-                auto [min_x, min_y, max_x, max_y] = menu_geometry(item.submenu);
-                if (pointer_x >= min_x && pointer_x <= max_x && pointer_y >= min_y && pointer_y <= max_y) {
-                    path.push_back(i);
-                    current = &item.submenu;
-                    found = true;
-                    break;
-                }
-            }
-        }
-        if (!found) break;
+// Point the shared pango context at the output scale and re-measure the tree.
+// Does nothing unless the scale or font description changed since last time.
+static void update_layouts(wl_state* state, double scale) {
+    if (state->layout_scale == scale && state->layout_desc == desc)
+        return;
+    if (state->label_cache.scale != scale) {
+        clear_label_cache(state->label_cache);
+        state->label_cache.scale = scale;
     }
-    return path;
-}
 
-std::vector<int> wl_state::find_hovered_path() {
-    std::vector<int> path;
-    std::function<bool(const MenuList&, std::vector<int>&)> helper;
-    helper = [&](const MenuList& menu_list, std::vector<int>& path) -> bool {
-        for (size_t i = 0; i < menu_list.size(); ++i) {
-            const MenuItem& item = menu_list[i];
-            if (item.in_box()) {
-                path.push_back((int)i);
-                return true;
-            }
-        }
-        for (size_t i = 0; i < menu_list.size(); ++i) {
-            const MenuItem& item = menu_list[i];
-            if (!item.submenu.empty()) {
-                std::vector<int> subpath;
-                if (helper(item.submenu, subpath)) {
-                    path.push_back((int)i);
-                    path.insert(path.end(), subpath.begin(), subpath.end());
-                    return true;
-                }
-            }
-        }
-        return false;
-    };
-    helper(menu, path);
-    return path;
-}
-
-// Recursive geometry assignment
-static RenderedMenuGeometry measure_menu_items(
-    MenuList& menu_list,
-    cairo_t* cr,
-    int base_x = 0,
-    int base_y = 0
-) {
-    int max_text_width = 0;
-    std::vector<std::pair<int, int>> text_sizes;
-
-    for (auto& item : menu_list) {
-        if (item.is_separator) {
-            text_sizes.push_back({0, 0});
-            continue;
-        }
-        PangoLayout *layout = pango_cairo_create_layout(cr);
-        pango_layout_set_font_description(layout, desc);
-        pango_layout_set_text(layout, item.label.c_str(), -1);
+    // An own font map rather than the default, which is per thread
+    if (!state->pango) {
+        state->font_map = pango_cairo_font_map_new();
+        state->pango = pango_font_map_create_context(state->font_map);
+    }
 
-        int text_width, text_height;
-        pango_layout_get_pixel_size(layout, &text_width, &text_height);
-        text_sizes.push_back({text_width, text_height});
-        g_object_unref(layout);
+    scale_pango_context(state->pango, scale);
 
-        int total_width = text_width + 2 * text_padding;
-        if (!item.submenu.empty()) total_width += 20; // space for arrow
-        if (total_width > max_text_width) max_text_width = total_width;
-    }
+    check_image_extents(state->menu, font, scale);
+    TraceScope span("measure");
+    measure_menu(state->menu, state->pango, desc);
+    state->layout_scale = scale;
+    state->layout_desc = desc;
+}
 
-    int logical_width = max_text_width;
-    if (logical_width < min_width) logical_width = min_width;
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
 
-    // Compute the y position for each item, accounting for separators
-    int y = base_y;
-    for (size_t i = 0; i < menu_list.size(); ++i) {
-        auto& item = menu_list[i];
-        item.x = base_x;
-        item.y = y;
-        if (item.is_separator) {
-            item.w = logical_width;
-            item.h = separator_size;
-        } else {
-            item.w = logical_width;
-            item.h = button_height;
-        }
-        y += item.h + button_spacing;
+// Where startup time goes, phase by phase, printed to stderr when
+// RMENU_TIMING is set
+class StartupTimer {
+  public:
+    StartupTimer() : enabled(getenv("RMENU_TIMING") != nullptr), start(now_ms()), last(start) {}
+    void phase(const char *name) {
+        double t = now_ms();
+        report(name, t - last);
+        last = t;
     }
+    void report(const char *name, double ms) {
+        if (enabled) fprintf(stderr, "rmenu: %-16s %8.2f ms\n", name, ms);
+    }
+    void total() { report("total", now_ms() - start); }
 
-    int logical_height = y - base_y - button_spacing;
+  private:
+    bool enabled;
+    double start;
+    double last;
+};
 
-    // Recursively assign for submenus
-    for (size_t i = 0; i < menu_list.size(); ++i) {
-        if (!menu_list[i].submenu.empty()) {
-            cairo_surface_t *temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-            cairo_t *temp_cr = cairo_create(temp_surface);
-            measure_menu_items(
-                menu_list[i].submenu,
-                temp_cr,
-                base_x + logical_width, // right of this menu
-                menu_list[i].y // vertical position aligned with item
-            );
-            cairo_destroy(temp_cr);
-            cairo_surface_destroy(temp_surface);
-        }
-    }
+// Panels are cut to this height while the output's is still unknown, so
+// warming up a long list does not shape rows that cannot be on screen
+static const int warmup_height = 4096;
+
+// Font setup is the slowest part of a cold start, as fontconfig loads its
+// configuration and caches on first use. It runs on its own thread while
+// the Wayland handshake is in flight, shaping the labels at scale 1, or at
+// the scale a compiled menu was made for; they are only shaped again if the
+// output turns out to be scaled otherwise.
+static void warm_up_text(wl_state *state, double *elapsed) {
+    TraceScope span("warm up text");
+    double start = now_ms();
+    desc = pango_font_description_from_string(font);
+    set_menu_max_height(state->menu, warmup_height);
+    update_layouts(state, state->menu.extents_scale ? state->menu.extents_scale : 1);
+    *elapsed = now_ms() - start;
+}
+
+bool wl_state::handle_menu_click() {
+    MenuPath& path = hit_path;
+    find_hovered_path(path);
+    if (path.empty()) return false;
 
-    RenderedMenuGeometry geom = { logical_width, logical_height };
-    return geom;
+    const MenuPanel *panel = &menu.panels[0];
+    for (size_t level = 0; level + 1 < path.size(); ++level)
+        panel = &menu.panels[menu.links[menu.item(*panel, path[level])].panel];
+    int32_t id = menu.item(*panel, path.back());
+    if (menu.has_submenu(id)) return false;
+
+    selected = id;
+    running = false;
+    return true;
 }
 
-bool wl_state::handle_menu_click(MenuList& menu_list) {
-    for (auto& item : menu_list) {
-        if (item.is_separator) continue;
-        if (item.in_box() && item.submenu.empty()) {
-            if (item.output.empty()) {
-              printf("%s\n", item.label.c_str());
-            } else {
-              printf("%s\n", item.output.c_str());
-            }
-            fflush(stdout);
-            running = false;
-            return true;
-        } else if (!item.submenu.empty() && handle_menu_click(item.submenu)) {
-            return true;
-        }
-    }
-    return false;
+// One pointer event as a line of the trace: milliseconds since the menu
+// showed, a letter for the event and up to three integer arguments, with
+// positions in wl_fixed_t so they replay exactly. rmenu-replay reads these.
+static void record_event(wl_state *state, char op, int nargs = 0, int a = 0, int b = 0, int c = 0) {
+    if (!state->trace) return;
+    fprintf(state->trace, "%.3f %c", now_ms() - state->trace_start, op);
+    int args[] = { a, b, c };
+    for (int i = 0; i < nargs; ++i)
+        fprintf(state->trace, " %d", args[i]);
+    fputc('\n', state->trace);
+}
+
+// The daemon's pointer keeps getting events between menus, when there are
+// no panels for them to land on
+static bool popup_mapped(const wl_state *state) {
+    return state->surface && !state->panel_surfaces.empty() && !state->menu.empty();
+}
+
+// Events arrive in the coordinates of whichever panel surface has focus;
+// the menu model works in the root surface's coordinates
+static void set_pointer_position(wl_state *state, wl_fixed_t sx, wl_fixed_t sy) {
+    const PanelSurface& ps = state->panel_surfaces[state->pointer_level];
+    int origin_x = state->pointer_level ? ps.shown.bounds.x : 0;
+    int origin_y = state->pointer_level ? ps.shown.bounds.y : 0;
+    int y = origin_y + wl_fixed_to_double(sy);
+    if (y != state->pointer_y) state->pointer_dy = y > state->pointer_y ? 1 : -1;
+    state->pointer_x = origin_x + wl_fixed_to_double(sx);
+    state->pointer_y = y;
+    state->pointer_moved = true;
 }
 
 static void pointer_motion(void *data, struct wl_pointer *, uint32_t, wl_fixed_t sx, wl_fixed_t sy) {
     wl_state *state = static_cast<wl_state*>(data);
-    state->pointer_x = wl_fixed_to_double(sx);
-    state->pointer_y = wl_fixed_to_double(sy);
+    record_event(state, 'm', 2, sx, sy);
+    if (state->pointer_inside && popup_mapped(state)) set_pointer_position(state, sx, sy);
+}
 
-    auto new_hovered_path = state->find_hovered_path();
-    if (state->hovered_path != new_hovered_path && new_hovered_path.size()) {
-        state->hovered_path = std::move(new_hovered_path);
-        if (state->buffer) wl_buffer_destroy(state->buffer);
-        state->buffer = create_buffer(state);
-        wl_surface_attach(state->surface, state->buffer, 0, 0);
-        wl_surface_damage_buffer(state->surface, 0, 0, state->width, state->height);
-        wl_surface_commit(state->surface);
+static void pointer_enter(void *data, struct wl_pointer *, uint32_t, struct wl_surface *surface, wl_fixed_t sx, wl_fixed_t sy) {
+    wl_state *state = static_cast<wl_state*>(data);
+    state->pointer_moved = true;
+    for (size_t level = 0; level < state->panel_surfaces.size(); ++level) {
+        if (state->panel_surfaces[level].surface == surface) {
+            record_event(state, 'e', 3, level, sx, sy);
+            state->pointer_inside = true;
+            state->pointer_entered = true;
+            state->pointer_level = level;
+            set_pointer_position(state, sx, sy);
+            return;
+        }
     }
+    // Entering the click-away layer counts as leaving the menu
+    record_event(state, 'e', 3, -1, sx, sy);
+    state->pointer_inside = false;
 }
 
-static void pointer_enter(void *data, struct wl_pointer *, uint32_t, struct wl_surface *, wl_fixed_t sx, wl_fixed_t sy) {
+static void pointer_leave(void *data, struct wl_pointer *, uint32_t, struct wl_surface *) {
     wl_state *state = static_cast<wl_state*>(data);
-    state->pointer_inside = true;
-    state->pointer_x = wl_fixed_to_double(sx);
-    state->pointer_y = wl_fixed_to_double(sy);
+    record_event(state, 'l');
+    state->pointer_inside = false;
+    state->pointer_moved = true;
+}
 
-    auto new_hovered_path = state->find_hovered_path();
-    if (state->hovered_path != new_hovered_path) {
-        state->hovered_path = std::move(new_hovered_path);
-        if (state->buffer) wl_buffer_destroy(state->buffer);
-        state->buffer = create_buffer(state);
-        wl_surface_attach(state->surface, state->buffer, 0, 0);
-        wl_surface_damage_buffer(state->surface, 0, 0, state->width, state->height);
-        wl_surface_commit(state->surface);
+// Scroll the panel under the pointer. What is under the pointer changes
+// with it, so the hover is looked up again like after a motion.
+static void scroll_pointer_panel(wl_state *state) {
+    int dy = (int)state->pointer_scroll;
+    state->pointer_scroll = 0;
+    if (!dy || !state->pointer_inside) return;
+    for (const OpenPanel& panel : state->drawn_panels) {
+        if (!panel.contains(state->pointer_x, state->pointer_y)) continue;
+        if (scroll_panel(state->menu, panel.panel, dy)) {
+            state->pointer_moved = true;
+            schedule_redraw(state);
+        }
+        return;
     }
 }
 
-static void pointer_leave(void *data, struct wl_pointer *, uint32_t, struct wl_surface *) {
+static void pointer_frame(void *data, struct wl_pointer *) {
     wl_state *state = static_cast<wl_state*>(data);
-    state->pointer_inside = false;
-    if (!state->hovered_path.empty()) {
-        state->hovered_path.clear();
-        if (state->buffer) wl_buffer_destroy(state->buffer);
-        state->buffer = create_buffer(state);
-        wl_surface_attach(state->surface, state->buffer, 0, 0);
-        wl_surface_damage_buffer(state->surface, 0, 0, state->width, state->height);
-        wl_surface_commit(state->surface);
+    TraceScope span("pointer frame");
+    record_event(state, 'f');
+    if (!popup_mapped(state)) return;
+    scroll_pointer_panel(state);
+    if (!state->pointer_moved) return;
+    state->pointer_moved = false;
+
+    if (!state->pointer_inside) {
+        state->pointer_entered = false;
+        if (!state->hovered_path.empty()) {
+            state->hovered_path.clear();
+            schedule_redraw(state);
+        }
+        return;
+    }
+
+    // Plain motion over a gap keeps the current hover; entering does not
+    MenuPath& new_hovered_path = state->hit_path;
+    state->find_hovered_path(new_hovered_path);
+    if (state->hovered_path != new_hovered_path &&
+            (new_hovered_path.size() || state->pointer_entered)) {
+        state->hovered_path.assign(new_hovered_path);
+        schedule_redraw(state);
     }
+    state->pointer_entered = false;
 }
 
 static void pointer_button(void *data, struct wl_pointer *, uint32_t, uint32_t, uint32_t button, uint32_t state_wl) {
     wl_state *state = static_cast<wl_state*>(data);
+    record_event(state, 'b', 2, button, state_wl);
+    if (!popup_mapped(state)) return;
     if (button == BTN_LEFT && state_wl == WL_POINTER_BUTTON_STATE_PRESSED) {
-        state->handle_menu_click(state->menu);
+        state->handle_menu_click();
     }
 }
 
-static void pointer_axis(void *, struct wl_pointer *, uint32_t, uint32_t, wl_fixed_t) {}
-static void pointer_frame(void *, struct wl_pointer *) {}
+static void pointer_axis(void *data, struct wl_pointer *, uint32_t, uint32_t axis, wl_fixed_t value) {
+    wl_state *state = static_cast<wl_state*>(data);
+    record_event(state, 'a', 2, axis, value);
+    if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
+        state->pointer_scroll += wl_fixed_to_double(value);
+}
 static void pointer_axis_source(void *, struct wl_pointer *, uint32_t) {}
 static void pointer_axis_stop(void *, struct wl_pointer *, uint32_t, uint32_t) {}
 static void pointer_axis_discrete(void *, struct wl_pointer *, uint32_t, int32_t) {}
@@ -363,6 +525,238 @@ static const struct wl_pointer_listener pointer_listener = {
     .axis_relative_direction = 0
 };
 
+// The panel open at `level` of the hovered path
+int wl_state::panel_at(size_t level) {
+    int panel = 0;
+    for (size_t l = 0; l < level; ++l)
+        panel = open_submenu(menu, menu.item(menu.panels[panel], hovered_path[l]), pango, desc);
+    return panel;
+}
+
+// The level keys act on: that of the focused item, or that of a filtered
+// panel with nothing left in it to focus
+size_t wl_state::focus_level() {
+    if (menu.filter.panel >= 0 && filter_level == hovered_path.size()) return filter_level;
+    return hovered_path.size() ? hovered_path.size() - 1 : 0;
+}
+
+// First item from `pos` on, going by `step`, that is not a separator
+static int seek_item(const Menu& menu, const MenuPanel& panel, int pos, int step) {
+    for (; pos >= 0 && pos < (int)panel.count; pos += step) {
+        if (!menu.separator[menu.item(panel, pos)]) return pos;
+    }
+    return -1;
+}
+
+// Item nearest to `pos` that is not a separator, preferring the `step` side
+static int nearest_item(const Menu& menu, const MenuPanel& panel, int pos, int step) {
+    int found = seek_item(menu, panel, pos, step);
+    return found >= 0 ? found : seek_item(menu, panel, pos, -step);
+}
+
+// Put the keyboard focus on `pos` in the panel at `level`, closing
+// anything deeper, and scroll it into view
+void wl_state::focus_item(size_t level, int pos) {
+    hovered_path.truncate(level);
+    if (pos >= 0) {
+        hovered_path.push_back(pos);
+        // The panels on the way down are measured as they are opened
+        measure_dirty_panels(menu, pango, desc);
+        reveal_item(menu, panel_at(level), pos);
+    }
+    schedule_redraw(this);
+}
+
+// Open the way down to an item and put the focus on it
+void wl_state::hover_item(int32_t id) {
+    std::vector<int32_t> chain;
+    for (int32_t i = id; i > 0; i = menu.links[i].parent)
+        chain.push_back(i);
+    hovered_path.clear();
+    measure_dirty_panels(menu, pango, desc);
+    for (size_t level = 0; level < chain.size(); ++level) {
+        int32_t item = chain[chain.size() - 1 - level];
+        int panel = level ? open_submenu(menu, menu.links[item].parent, pango, desc) : 0;
+        const MenuPanel& mp = menu.panels[panel];
+        const int32_t *run = menu.panel_items.data() + mp.first;
+        int pos = std::find(run, run + mp.count, item) - run;
+        if (pos == (int)mp.count) break;
+        hovered_path.push_back(pos);
+        reveal_item(menu, panel, pos);
+    }
+    schedule_redraw(this);
+}
+
+// Drop the filter. The focused item stays focused, now where it is listed
+// in the full menu.
+void wl_state::clear_filter() {
+    if (menu.filter.panel < 0) return;
+    int32_t focused = -1;
+    if (hovered_path.size())
+        focused = menu.item(menu.panels[panel_at(hovered_path.size() - 1)], hovered_path.back());
+    clear_menu_filter(menu);
+    if (focused >= 0) {
+        hover_item(focused);
+    } else {
+        schedule_redraw(this);
+    }
+}
+
+// Filter by `query` at the focused level, or the whole tree, and focus the
+// first match. An empty query shows everything again.
+void wl_state::filter(std::string query) {
+    if (query.empty()) {
+        clear_filter();
+        return;
+    }
+    size_t level = menu.filter.panel >= 0 ? filter_level : filter_tree ? 0 : focus_level();
+    int panel = filter_tree ? 0 : panel_at(level);
+    filter_menu(menu, panel, filter_tree, query.data(), query.size());
+    filter_level = level;
+    focus_item(level, seek_item(menu, menu.panels[panel], 0, 1));
+}
+
+void wl_state::handle_key(xkb_keysym_t sym, const char *text) {
+    size_t level = focus_level();
+    measure_dirty_panels(menu, pango, desc);
+    int panel = panel_at(level);
+    const MenuPanel& mp = menu.panels[panel];
+    int count = mp.count;
+    int pos = level < hovered_path.size() ? hovered_path[level] : -1;
+    int32_t id = pos >= 0 ? menu.item(mp, pos) : -1;
+    int page = std::max(1, mp.bounds.h / (button_height + button_spacing));
+    bool filtered_here = menu.filter.panel >= 0 && filter_level == level;
+
+    int next;
+    switch (sym) {
+    case XKB_KEY_Down:
+        next = seek_item(menu, mp, pos + 1, 1);
+        focus_item(level, next >= 0 ? next : seek_item(menu, mp, 0, 1));
+        break;
+    case XKB_KEY_Up:
+        next = pos >= 0 ? seek_item(menu, mp, pos - 1, -1) : -1;
+        focus_item(level, next >= 0 ? next : seek_item(menu, mp, count - 1, -1));
+        break;
+    case XKB_KEY_Home:
+        focus_item(level, seek_item(menu, mp, 0, 1));
+        break;
+    case XKB_KEY_End:
+        focus_item(level, seek_item(menu, mp, count - 1, -1));
+        break;
+    case XKB_KEY_Page_Down:
+        next = std::min(std::max(pos, 0) + page, count - 1);
+        focus_item(level, nearest_item(menu, mp, next, 1));
+        break;
+    case XKB_KEY_Page_Up:
+        next = std::max(pos - page, 0);
+        focus_item(level, nearest_item(menu, mp, next, -1));
+        break;
+    case XKB_KEY_Right:
+    case XKB_KEY_Return:
+    case XKB_KEY_KP_Enter:
+        if (id < 0) break;
+        if (menu.has_submenu(id)) {
+            int child = open_submenu(menu, id, pango, desc);
+            focus_item(level + 1, seek_item(menu, menu.panels[child], 0, 1));
+        } else if (sym != XKB_KEY_Right) {
+            selected = id;
+            running = false;
+        }
+        break;
+    case XKB_KEY_Left:
+        if (!level) break;
+        if (filtered_here) clear_filter();
+        focus_item(level, -1);
+        break;
+    case XKB_KEY_Escape:
+        if (menu.filter.panel >= 0) {
+            clear_filter();
+        } else {
+            running = false;
+        }
+        break;
+    case XKB_KEY_BackSpace:
+        if (filtered_here) {
+            std::string query = menu.filter.query;
+            while (!query.empty() && (query.back() & 0xc0) == 0x80) query.pop_back();
+            if (!query.empty()) query.pop_back();
+            filter(query);
+        }
+        break;
+    case XKB_KEY_Tab:
+    case XKB_KEY_ISO_Left_Tab:
+        filter_tree = !filter_tree;
+        if (menu.filter.panel >= 0) {
+            std::string query = menu.filter.query;
+            clear_filter();
+            filter(query);
+        }
+        break;
+    default:
+        // Text extends the query of a filter at this level, or starts one
+        if (!text[0] || (unsigned char)text[0] < 0x20 || text[0] == 0x7f) break;
+        if (menu.filter.panel >= 0 && !filtered_here) clear_filter();
+        filter((menu.filter.panel >= 0 ? menu.filter.query : std::string()) + text);
+        break;
+    }
+}
+
+static void keyboard_keymap(void *data, struct wl_keyboard *, uint32_t format, int32_t fd, uint32_t size) {
+    wl_state *state = static_cast<wl_state*>(data);
+    if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+        close(fd);
+        return;
+    }
+    char *map = static_cast<char *>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    if (!state->xkb) state->xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    struct xkb_keymap *keymap = state->xkb ? xkb_keymap_new_from_string(state->xkb, map,
+        XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS) : nullptr;
+    munmap(map, size);
+    if (!keymap) return;
+
+    if (state->key_state) xkb_state_unref(state->key_state);
+    if (state->keymap) xkb_keymap_unref(state->keymap);
+    state->keymap = keymap;
+    state->key_state = xkb_state_new(keymap);
+}
+
+static void keyboard_enter(void *, struct wl_keyboard *, uint32_t, struct wl_surface *, struct wl_array *) {}
+static void keyboard_leave(void *, struct wl_keyboard *, uint32_t, struct wl_surface *) {}
+
+static void keyboard_key(void *data, struct wl_keyboard *, uint32_t, uint32_t, uint32_t key, uint32_t state_wl) {
+    wl_state *state = static_cast<wl_state*>(data);
+    if (state_wl != WL_KEYBOARD_KEY_STATE_PRESSED || !state->key_state) return;
+    if (!state->running || !state->configured || !state->text_ready) return;
+
+    // Evdev key codes are 8 below XKB's
+    xkb_keysym_t sym = xkb_state_key_get_one_sym(state->key_state, key + 8);
+    char text[16] = "";
+    if (!xkb_state_mod_name_is_active(state->key_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_EFFECTIVE))
+        xkb_state_key_get_utf8(state->key_state, key + 8, text, sizeof(text));
+    state->handle_key(sym, text);
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *, uint32_t, uint32_t depressed,
+                               uint32_t latched, uint32_t locked, uint32_t group) {
+    wl_state *state = static_cast<wl_state*>(data);
+    if (state->key_state)
+        xkb_state_update_mask(state->key_state, depressed, latched, locked, 0, 0, group);
+}
+
+static void keyboard_repeat_info(void *, struct wl_keyboard *, int32_t, int32_t) {}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+    .keymap = keyboard_keymap,
+    .enter = keyboard_enter,
+    .leave = keyboard_leave,
+    .key = keyboard_key,
+    .modifiers = keyboard_modifiers,
+    .repeat_info = keyboard_repeat_info,
+};
+
 static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t caps) {
     wl_state *state = static_cast<wl_state*>(data);
     if (caps & WL_SEAT_CAPABILITY_POINTER) {
@@ -376,6 +770,17 @@ static void seat_capabilities(void *data, struct wl_seat *seat, uint32_t caps) {
             state->pointer = nullptr;
         }
     }
+    if (caps & WL_SEAT_CAPABILITY_KEYBOARD) {
+        if (!state->keyboard) {
+            state->keyboard = wl_seat_get_keyboard(seat);
+            wl_keyboard_add_listener(state->keyboard, &keyboard_listener, state);
+        }
+    } else {
+        if (state->keyboard) {
+            wl_keyboard_destroy(state->keyboard);
+            state->keyboard = nullptr;
+        }
+    }
 }
 static void seat_name(void *, struct wl_seat *, const char *) {}
 
@@ -393,12 +798,24 @@ static void registry_global(void *data, struct wl_registry *registry,
     if (strcmp(interface, wl_compositor_interface.name) == 0) {
         state->compositor = static_cast<struct wl_compositor *>(wl_registry_bind(
             registry, name, &wl_compositor_interface, 4));
+    } else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+        state->subcompositor = static_cast<struct wl_subcompositor *>(wl_registry_bind(
+            registry, name, &wl_subcompositor_interface, 1));
     } else if (strcmp(interface, wl_shm_interface.name) == 0) {
         state->shm = static_cast<struct wl_shm *>(wl_registry_bind(
             registry, name, &wl_shm_interface, 1));
     } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
         state->layer_shell = static_cast<struct zwlr_layer_shell_v1 *>(wl_registry_bind(
             registry, name, &zwlr_layer_shell_v1_interface, 1));
+    } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        state->viewporter = static_cast<struct wp_viewporter *>(wl_registry_bind(
+            registry, name, &wp_viewporter_interface, 1));
+    } else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+        state->single_pixel = static_cast<struct wp_single_pixel_buffer_manager_v1 *>(wl_registry_bind(
+            registry, name, &wp_single_pixel_buffer_manager_v1_interface, 1));
+    } else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+        state->fractional_scale_manager = static_cast<struct wp_fractional_scale_manager_v1 *>(wl_registry_bind(
+            registry, name, &wp_fractional_scale_manager_v1_interface, 1));
     } else if (strcmp(interface, wl_output_interface.name) == 0) {
         struct wl_output *output = static_cast<struct wl_output*>(wl_registry_bind(
             registry, name, &wl_output_interface, (version >= 2) ? 2 : 1));
@@ -429,9 +846,11 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_global_remove,
 };
 
-static void layer_surface_configure(void *, struct zwlr_layer_surface_v1 *layer_surface,
+static void layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
                                    uint32_t serial, uint32_t, uint32_t) {
+    wl_state *state = static_cast<wl_state *>(data);
     zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
+    state->configured = true;
 }
 
 static void layer_surface_closed(void *data,
@@ -450,6 +869,12 @@ static void bg_layer_surface_configure(void *data,
                                       struct zwlr_layer_surface_v1 *layer_surface,
                                       uint32_t serial, uint32_t width, uint32_t height) {
     zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
+    // This layer covers the whole output, so no panel may be taller
+    wl_state *state = static_cast<wl_state *>(data);
+    attach_bg_buffer(state, width, height);
+    if (!state->text_ready) return; // picked up once startup hands it over
+    set_menu_max_height(state->menu, height);
+    if (state->configured && state->menu.dirty) schedule_redraw(state);
 }
 static void bg_layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *) {
     wl_state *state = static_cast<wl_state *>(data);
@@ -487,121 +912,13 @@ static const struct wl_pointer_listener bg_pointer_listener = {
     .axis_relative_direction = 0,
 };
 
-static void render_menu_branch(
-    cairo_t* cr,
-    MenuList& menu_list,
-    wl_state* state,
-    size_t level
-) {
-    if (menu_list.empty()) return;
-    menu_list.last_rendered = state->current_frame;
-    auto& hovered_path = state->hovered_path;
-
-    // Compute bounding rect for this menu
-    int min_x = menu_list[0].x, min_y = menu_list[0].y, max_x = menu_list[0].max_x(), max_y = menu_list[0].max_y();
-    for (const auto& it : menu_list) {
-        min_x = std::min(min_x, it.x);
-        min_y = std::min(min_y, it.y);
-        max_x = std::max(max_x, it.max_x());
-        max_y = std::max(max_y, it.max_y());
-    }
-    int menu_width = max_x - min_x;
-    int menu_height = max_y - min_y;
-
-    // Draw menu background
-    cairo_set_source_rgb(cr, menu_back[0], menu_back[1], menu_back[1]);
-    cairo_rectangle(cr, min_x, min_y, menu_width, menu_height);
-    cairo_fill(cr);
-
-    // Draw all menu items
-    for (size_t i = 0; i < menu_list.size(); ++i) {
-        auto& item = menu_list[i];
-        item.last_rendered = state->current_frame;
-
-        if (item.is_separator) {
-            //Draw horizontal line in the center of the separator box
-            double sep_y = item.y;
-            cairo_set_source_rgb(cr, sep_color[0], sep_color[1], sep_color[2]);
-            cairo_set_line_width(cr, separator_size);
-            cairo_move_to(cr, item.x + 5, sep_y + separator_size/2.0);
-            cairo_line_to(cr, item.x + item.w - 5, sep_y + separator_size/2.0);
-            cairo_stroke(cr);
-            continue;
-        }
-
-        // Highlight hovered item at this level
-        bool is_hovered = (hovered_path.size() > level && hovered_path[level] == (int)i);
-
-        // Button background color
-        if (is_hovered)
-            cairo_set_source_rgb(cr, hovered_color[0], hovered_color[1], hovered_color[2]);
-        else
-            cairo_set_source_rgb(cr, button_color[0], button_color[1], button_color[2]);
-
-        cairo_rectangle(cr, item.x, item.y, item.w, item.h);
-        cairo_fill(cr);
-
-        // Draw button border
-        cairo_set_source_rgb(cr, border_color[0], border_color[1], border_color[2]);
-        cairo_set_line_width(cr, 1.0);
-        cairo_rectangle(cr, item.x, item.y, item.w, item.h);
-        cairo_stroke(cr);
-
-        // Draw text
-        cairo_set_source_rgb(cr, text_color[0], text_color[1], text_color[2]);
-        PangoLayout *layout = pango_cairo_create_layout(cr);
-        pango_layout_set_font_description(layout, desc);
-        pango_layout_set_text(layout, item.label.c_str(), -1);
-
-        int text_width, text_height;
-        pango_layout_get_pixel_size(layout, &text_width, &text_height);
-
-        cairo_move_to(cr, item.x + text_padding, item.y + (item.h - text_height) / 2);
-        pango_cairo_show_layout(cr, layout);
-
-        // Draw arrow for submenu
-        if (!item.submenu.empty()) {
-            double arrow_size = text_height * 0.5;
-            double arrow_margin = 4.0; // distance from right edge
-            double arrow_x = item.x + item.w - arrow_size - arrow_margin;
-            double arrow_y = item.y + (item.h - arrow_size) / 2;
-            cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-            cairo_move_to(cr, arrow_x, arrow_y);
-            cairo_line_to(cr, arrow_x + arrow_size, arrow_y + arrow_size / 2);
-            cairo_line_to(cr, arrow_x, arrow_y + arrow_size);
-            cairo_close_path(cr);
-            cairo_fill(cr);
-        }
-
-        g_object_unref(layout);
-    }
-
-    // If a submenu should be open, recursively render it
-    if (hovered_path.size() > level) {
-        int idx = hovered_path[level];
-        if (idx >= 0 && idx < (int)menu_list.size() && !menu_list[idx].submenu.empty()) {
-            render_menu_branch(cr, menu_list[idx].submenu, state, level + 1);
-        }
-    } else if (auto sm_path = state->find_submenu_path(); sm_path.size() > level) {
-        int idx = sm_path[level];
-        if (idx >= 0 && idx < (int)menu_list.size() && !menu_list[idx].submenu.empty()) {
-            render_menu_branch(cr, menu_list[idx].submenu, state, level + 1);
-        }
-    }
-}
-static void render_menu_items(
-    cairo_t* cr,
-    wl_state* state
-) {
-    state->current_frame++;
-    render_menu_branch(cr, state->menu, state, 0);
-}
-
+// A fresh memfd reads as zeros, which is fully transparent ARGB, so the
+// buffer is never mapped or written by us
 static struct wl_buffer *create_transparent_buffer(wl_state *state, int width, int height) {
     int stride = width * 4;
     int size = stride * height;
 
-    int fd = memfd_create("wayland-shm", 0);
+    int fd = memfd_create("wayland-shm", MFD_CLOEXEC);
     if (fd < 0) {
         return nullptr;
     }
@@ -609,292 +926,1512 @@ static struct wl_buffer *create_transparent_buffer(wl_state *state, int width, i
         close(fd);
         return nullptr;
     }
-    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        close(fd);
-        return nullptr;
-    }
-
-    memset(data, 0, size);
 
     struct wl_shm_pool *pool = wl_shm_create_pool(state->shm, fd, size);
     struct wl_buffer *buffer = wl_shm_pool_create_buffer(
         pool, 0, width, height, stride, WL_SHM_FORMAT_ARGB8888);
     wl_shm_pool_destroy(pool);
-
-    munmap(data, size);
     close(fd);
 
     return buffer;
 }
 
-static struct wl_buffer *create_buffer(wl_state *state) {
-    int scale = state->chosen_scale;
+// Fill the click-away layer with nothing, at the size it was configured
+// to. With wp_viewporter one transparent pixel is stretched over the whole
+// output: a single-pixel buffer if the compositor has them, otherwise a
+// 1x1 shm buffer. Without it the shm buffer has to match the output.
+static void attach_bg_buffer(wl_state *state, uint32_t width, uint32_t height) {
+    if (!width || !height) return;
+    if (state->bg_buffer && width == state->bg_width && height == state->bg_height) return;
+
+    if (state->viewporter) {
+        if (!state->bg_viewport)
+            state->bg_viewport = wp_viewporter_get_viewport(state->viewporter, state->bg_surface);
+        if (!state->bg_buffer) {
+            state->bg_buffer = state->single_pixel
+                ? wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(state->single_pixel, 0, 0, 0, 0)
+                : create_transparent_buffer(state, 1, 1);
+        }
+        wp_viewport_set_destination(state->bg_viewport, width, height);
+    } else {
+        if (state->bg_buffer) wl_buffer_destroy(state->bg_buffer);
+        state->bg_buffer = create_transparent_buffer(state, width, height);
+    }
+    if (!state->bg_buffer) return;
+
+    state->bg_width = width;
+    state->bg_height = height;
+    wl_surface_attach(state->bg_surface, state->bg_buffer, 0, 0);
+    wl_surface_damage_buffer(state->bg_surface, 0, 0, INT32_MAX, INT32_MAX);
+    wl_surface_commit(state->bg_surface);
+}
 
-    cairo_surface_t *temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-    cairo_t *temp_cr = cairo_create(temp_surface);
+static void buffer_release(void *data, struct wl_buffer *buffer) {
+    wl_state *state = static_cast<wl_state*>(data);
+    for (auto& ps : state->panel_surfaces) {
+        for (auto& slot : ps.pool.slots) {
+            if (slot.buffer == buffer) slot.busy = false;
+        }
+    }
+    if (state->redraw_pending && !state->frame_callback) redraw(state);
+}
 
-    // Assign geometry to all menu items (including submenus)
-    RenderedMenuGeometry geom = measure_menu_items(state->menu, temp_cr);
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
 
-    int logical_width = geom.width;
-    int logical_height = geom.height;
+static bool shm_pool_grow(wl_state *state, ShmPool& pool, size_t size) {
+    if (size <= pool.size) return true;
 
-    // Compute max right and bottom edge for all open menu levels
-    int total_width = logical_width;
-    int total_height = logical_height;
+    if (pool.fd < 0) {
+        pool.fd = memfd_create("wayland-shm", MFD_CLOEXEC);
+        if (pool.fd < 0) return false;
+    }
+    if (ftruncate(pool.fd, size) < 0) return false;
 
-    // Traverse the hovered_path to determine the furthest right/bottom coordinate
-    const MenuList *current = &state->menu;
-    int level = 0;
+    void *data = pool.data
+        ? mremap(pool.data, pool.size, size, MREMAP_MAYMOVE)
+        : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool.fd, 0);
+    if (data == MAP_FAILED) return false;
+    pool.data = data;
 
-    // Start with main menu bounding box
-    int max_x = logical_width, max_y = logical_height;
+    if (pool.pool) {
+        wl_shm_pool_resize(pool.pool, size);
+    } else {
+        pool.pool = wl_shm_create_pool(state->shm, pool.fd, size);
+    }
+    pool.size = size;
 
-    while (state->hovered_path.size() > (size_t)level) {
-        int idx = state->hovered_path[level];
-        if (idx < 0 || idx >= (int)current->size())
-            break;
-        const MenuItem &item = (*current)[idx];
-        if (item.submenu.empty())
-            break;
+    size_t total = 0;
+    for (const auto& ps : state->panel_surfaces) total += ps.pool.size;
+    state->shm_peak = std::max(state->shm_peak, total);
+    return true;
+}
 
-        // Compute bounding box for this submenu
-        const MenuList &submenu = item.submenu;
-        if (!submenu.empty()) {
-            int sub_min_x = submenu[0].x, sub_min_y = submenu[0].y;
-            int sub_max_x = submenu[0].max_x(), sub_max_y = submenu[0].max_y();
-            for (const auto &it : submenu) {
-                sub_min_x = std::min(sub_min_x, it.x);
-                sub_min_y = std::min(sub_min_y, it.y);
-                sub_max_x = std::max(sub_max_x, it.max_x());
-                sub_max_y = std::max(sub_max_y, it.max_y());
+// Find a slot the compositor is not reading from and make it width x height.
+// Returns nullptr when every slot is still held by the compositor.
+static ShmBuffer *shm_pool_acquire(wl_state *state, ShmPool& pool, int width, int height) {
+    int stride = width * 4;
+    size_t needed = (size_t)stride * height;
+
+    ShmBuffer *free_slot = nullptr;
+    bool any_busy = false;
+    for (auto& slot : pool.slots) {
+        if (slot.busy) {
+            any_busy = true;
+            continue;
+        }
+        if (slot.buffer && slot.width == width && slot.height == height)
+            return &slot;
+        if (!free_slot || (slot.capacity >= needed && free_slot->capacity < needed))
+            free_slot = &slot;
+    }
+    if (!free_slot) return nullptr;
+
+    if (free_slot->capacity < needed) {
+        // Nothing in flight, so the whole mapping can be handed out again
+        if (!any_busy) {
+            for (auto& slot : pool.slots) {
+                if (slot.buffer) wl_buffer_destroy(slot.buffer);
+                slot = ShmBuffer();
             }
-            max_x = std::max(max_x, sub_max_x);
-            max_y = std::max(max_y, sub_max_y);
+            pool.used = 0;
         }
-
-        current = &item.submenu;
-        ++level;
+        if (!shm_pool_grow(state, pool, pool.used + needed)) return nullptr;
+        free_slot->offset = pool.used;
+        free_slot->capacity = needed;
+        pool.used += needed;
     }
 
-    total_width = max_x;
-    total_height = max_y;
+    if (free_slot->buffer) wl_buffer_destroy(free_slot->buffer);
+    free_slot->buffer = wl_shm_pool_create_buffer(pool.pool, free_slot->offset,
+        width, height, stride, WL_SHM_FORMAT_ARGB8888);
+    wl_buffer_add_listener(free_slot->buffer, &buffer_listener, state);
+    free_slot->width = width;
+    free_slot->height = height;
+    free_slot->stride = stride;
+    free_slot->full_damage = true;
+    return free_slot;
+}
 
-    cairo_destroy(temp_cr);
-    cairo_surface_destroy(temp_surface);
+static void shm_pool_destroy(ShmPool& pool) {
+    for (auto& slot : pool.slots) {
+        if (slot.buffer) wl_buffer_destroy(slot.buffer);
+        slot = ShmBuffer();
+    }
+    if (pool.pool) wl_shm_pool_destroy(pool.pool);
+    if (pool.data) munmap(pool.data, pool.size);
+    if (pool.fd >= 0) close(pool.fd);
+    pool = ShmPool();
+}
 
-    state->width = total_width * scale;
-    state->height = total_height * scale;
-    int stride = state->width * 4;
-    int size = stride * state->height;
+// The panels that are open follow hovered_path from the root menu
+static void collect_open_panels(wl_state *state, std::vector<OpenPanel>& panels) {
+    panels.clear();
+    Menu& menu = state->menu;
+    int current = 0;
+    size_t level = 0;
+    while (true) {
+        const MenuPanel& panel = menu.panels[current];
+        int idx = level < state->hovered_path.size() ? state->hovered_path[level] : -1;
+        panels.push_back({current, idx, panel.bounds});
+        if (idx < 0 || idx >= (int)panel.count)
+            break;
+        int32_t id = menu.item(panel, idx);
+        if (!menu.has_submenu(id))
+            break;
+        // Submenus are only built from the input when first opened
+        current = open_submenu(menu, id, state->pango, desc);
+        ++level;
+    }
+}
 
-    int fd = memfd_create("wayland-shm", 0);
-    if (fd < 0) {
-        return nullptr;
+// Damage in panel-local coordinates when a surface keeps showing the same
+// panel: only the buttons whose lit state flipped
+static void collect_damage(const Menu& menu, const OpenPanel& before, const OpenPanel& after,
+                           std::vector<Rect>& damage) {
+    damage.clear();
+    const MenuPanel& panel = menu.panels[after.panel];
+    for (int idx : { before.hovered, after.hovered }) {
+        if (idx < 0 || idx >= (int)panel.count) continue;
+        Rect r = item_rect(menu, panel, idx);
+        r.x -= after.bounds.x;
+        r.y -= after.bounds.y;
+        damage.push_back(r);
     }
-    if (ftruncate(fd, size) < 0) {
-        close(fd);
-        return nullptr;
+}
+
+// With fractional scaling every level's buffer is shown at the panel's
+// logical size through a viewport; otherwise by integer buffer scale
+static PanelSurface& ensure_panel_surface(wl_state *state, size_t level) {
+    PanelSurface& ps = state->panel_surfaces[level];
+    if (!ps.surface) {
+        ps.surface = wl_compositor_create_surface(state->compositor);
+        ps.subsurface = wl_subcompositor_get_subsurface(
+            state->subcompositor, ps.surface, state->surface);
+        if (!state->fractional_scale)
+            wl_surface_set_buffer_scale(ps.surface, state->chosen_scale);
     }
-    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        close(fd);
-        return nullptr;
+    if (state->fractional_scale && !ps.viewport)
+        ps.viewport = wp_viewporter_get_viewport(state->viewporter, ps.surface);
+    return ps;
+}
+
+// A panel-local rect in buffer pixels, rounded out to whole pixels
+static Rect buffer_rect(const Rect& r, double scale) {
+    int x0 = floor(r.x * scale);
+    int y0 = floor(r.y * scale);
+    int x1 = ceil((r.x + r.w) * scale);
+    int y1 = ceil((r.y + r.h) * scale);
+    return { x0, y0, x1 - x0, y1 - y0 };
+}
+
+// Copy the panel's cached raster into a pool slot. Only the areas the slot
+// is missing are touched: this frame's damage plus whatever changed while
+// the compositor was still holding the slot.
+static void paint_panel_buffer(wl_state *state, PanelSurface& ps, ShmBuffer *buffer,
+                               const OpenPanel& panel, bool frame_full) {
+    double scale = state->chosen_scale;
+    bool repaint_all = frame_full || buffer->full_damage;
+    state->repaint.clear();
+    if (!repaint_all) {
+        state->repaint.insert(state->repaint.end(), buffer->damage.begin(), buffer->damage.end());
+        state->repaint.insert(state->repaint.end(), state->frame_damage.begin(), state->frame_damage.end());
     }
 
+    unsigned char *data = static_cast<unsigned char *>(ps.pool.data) + buffer->offset;
     cairo_surface_t *cairo_surface = cairo_image_surface_create_for_data(
-        static_cast<unsigned char *>(data), CAIRO_FORMAT_ARGB32, state->width, state->height, stride);
+        data, CAIRO_FORMAT_ARGB32, buffer->width, buffer->height, buffer->stride);
     cairo_t *cr = cairo_create(cairo_surface);
 
+    // Clipped to whole pixels, so nothing is blended at the edges
+    if (!repaint_all) {
+        for (const auto& r : state->repaint) {
+            Rect b = buffer_rect(r, scale);
+            cairo_rectangle(cr, b.x, b.y, b.w, b.h);
+        }
+        cairo_clip(cr);
+    }
     cairo_scale(cr, scale, scale);
 
-    render_menu_items(cr, state);
+    // The raster is padded for border bleed, and already has everything
+    // the panel needs, so it simply replaces what the slot had. Its margin
+    // is whole pixels, so it is copied pixel for pixel at any scale.
+    const MenuPanel& mp = state->menu.panels[panel.panel];
+    double margin = raster_margin(scale) / scale;
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, mp.raster, -margin, -margin);
+    cairo_paint(cr);
 
     cairo_destroy(cr);
     cairo_surface_destroy(cairo_surface);
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(state->shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(
-        pool, 0, state->width, state->height, stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
+    // Every other slot now lags behind by this frame's damage
+    for (auto& slot : ps.pool.slots) {
+        if (&slot == buffer) continue;
+        if (frame_full || slot.damage.size() + state->frame_damage.size() > 32) {
+            slot.full_damage = true;
+            slot.damage.clear();
+        } else {
+            slot.damage.insert(slot.damage.end(), state->frame_damage.begin(), state->frame_damage.end());
+        }
+    }
+    buffer->damage.clear();
+    buffer->full_damage = false;
+}
 
-    munmap(data, size);
-    close(fd);
+static bool panel_changed(const PanelSurface& ps, const OpenPanel *panel) {
+    if (!panel) return ps.mapped;
+    return !ps.mapped || ps.stale || ps.shown.panel != panel->panel ||
+           ps.shown.hovered != panel->hovered;
+}
 
-    return buffer;
+static void frame_done(void *data, struct wl_callback *callback, uint32_t) {
+    wl_state *state = static_cast<wl_state*>(data);
+    TraceScope span("frame done");
+    wl_callback_destroy(callback);
+    state->frame_callback = nullptr;
+    if (state->redraw_pending) redraw(state);
 }
 
-static void parse_menu(wl_state* state) {
-    std::vector<MenuList*> stack;
-    stack.push_back(&state->menu);
-    bool prev_was_empty = false;
-    char line[256];
-    while (fgets(line, sizeof(line), stdin)) {
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+// Bring every level's surface in line with the open panels. Levels whose
+// panel did not change are left alone; a level that closed is unmapped by
+// attaching no buffer. Subsurfaces are synchronized, so everything becomes
+// visible together with the commit on the root surface.
+static void redraw(wl_state *state) {
+    if (!popup_mapped(state)) return;
+    state->redraw_pending = true;
+    update_layouts(state, state->chosen_scale);
+    {
+        TraceScope span("measure");
+        measure_dirty_panels(state->menu, state->pango, desc);
+    }
+    {
+        TraceScope span("open panels");
+        collect_open_panels(state, state->open_panels);
+    }
+    // Measuring drops rasters, including those of submenus measured as
+    // they were opened just now
+    for (auto& ps : state->panel_surfaces) {
+        if (ps.mapped && !state->menu.panels[ps.shown.panel].raster) ps.stale = true;
+    }
+
+    size_t levels = state->panel_surfaces.size();
+    auto open_at = [state](size_t level) -> const OpenPanel* {
+        return level < state->open_panels.size() ? &state->open_panels[level] : nullptr;
+    };
 
-        int tabs = strspn(line, "\t");
-        char* start = line + tabs;
+    // Claim all buffers first, so a frame is either shown whole or not at all
+    bool any_changed = false;
+    for (size_t level = 0; level < levels; ++level) {
+        const OpenPanel *panel = open_at(level);
+        state->panel_surfaces[level].next = nullptr;
+        if (!panel_changed(state->panel_surfaces[level], panel)) continue;
+        any_changed = true;
+        if (!panel) continue;
+        PanelSurface& ps = ensure_panel_surface(state, level);
+        double scale = state->chosen_scale;
+        TraceScope span("buffer acquire");
+        ps.next = shm_pool_acquire(state, ps.pool,
+            lround(panel->bounds.w * scale), lround(panel->bounds.h * scale));
+        if (!ps.next) return;
+    }
+    state->redraw_pending = false;
+    if (!any_changed) return;
+
+    double scale = state->chosen_scale;
+    state->raster_jobs.clear();
+    for (size_t level = 0; level < levels; ++level) {
+        const OpenPanel *panel = open_at(level);
+        if (!panel || !panel_changed(state->panel_surfaces[level], panel)) continue;
+        const MenuPanel& mp = state->menu.panels[panel->panel];
+        if (!mp.raster || mp.raster_scale != scale)
+            state->raster_jobs.push_back({ panel->panel, panel->hovered });
+    }
+    if (state->raster_jobs.size() > 1 && RasterPool::default_threads()) {
+        if (!state->raster_pool)
+            state->raster_pool.reset(new RasterPool(RasterPool::default_threads()));
+        state->rasterized_bytes += state->raster_pool->update(state->menu, state->raster_jobs, scale, desc);
+    }
 
-        // Handle empty line: add a separator
-        if (*start == '\0') {
-            prev_was_empty = true;
-            MenuItem sep;
-            sep.state = state;
-            sep.is_separator = true;
-            stack[0]->items.push_back(sep);
+    for (size_t level = 0; level < levels; ++level) {
+        PanelSurface& ps = state->panel_surfaces[level];
+        const OpenPanel *panel = open_at(level);
+        if (!panel_changed(ps, panel)) continue;
+
+        if (!panel) {
+            wl_surface_attach(ps.surface, nullptr, 0, 0);
+            wl_surface_commit(ps.surface);
+            ps.mapped = false;
+            ps.stale = false;
+            ps.shown = {-1, -1, {}};
             continue;
         }
-        if (tabs > 0 && prev_was_empty) {
-            fprintf(stderr, "No separators in submenus\n");
-            exit(1);
+
+        {
+            TraceScope span("render");
+            state->rasterized_bytes += update_panel_raster(state->menu, state->menu.panels[panel->panel],
+                                                           panel->hovered, scale);
+        }
+        ShmBuffer *buffer = ps.next;
+        bool frame_full = !ps.mapped || ps.stale || ps.shown.panel != panel->panel;
+        if (frame_full) {
+            state->frame_damage.assign(1, Rect{0, 0, panel->bounds.w, panel->bounds.h});
+        } else {
+            collect_damage(state->menu, ps.shown, *panel, state->frame_damage);
+        }
+        {
+            TraceScope span("copy to buffer");
+            paint_panel_buffer(state, ps, buffer, *panel, frame_full);
         }
 
-        MenuItem item;
-        item.state = state;
+        buffer->busy = true;
+        if (ps.subsurface)
+            wl_subsurface_set_position(ps.subsurface, panel->bounds.x, panel->bounds.y);
+        wl_surface_attach(ps.surface, buffer->buffer, 0, 0);
+        for (const auto& r : state->frame_damage) {
+            Rect d = buffer_rect(r, scale);
+            wl_surface_damage_buffer(ps.surface, d.x, d.y, d.w, d.h);
+        }
+        if (ps.viewport)
+            wp_viewport_set_destination(ps.viewport, panel->bounds.w, panel->bounds.h);
+        if (level == 0) {
+            state->width = buffer->width;
+            state->height = buffer->height;
+        } else {
+            wl_surface_commit(ps.surface);
+        }
+        ps.mapped = true;
+        ps.stale = false;
+        ps.shown = *panel;
+    }
+
+    TraceScope span("commit");
+    state->frame_callback = wl_surface_frame(state->surface);
+    wl_callback_add_listener(state->frame_callback, &frame_listener, state);
+    wl_surface_commit(state->surface);
+    state->drawn_panels.swap(state->open_panels);
+    release_closed_rasters(state);
+}
+
+// Draw now if the compositor is ready for a frame, otherwise on the next
+// frame callback. Any number of changes in between produce a single paint.
+static void schedule_redraw(wl_state *state) {
+    state->redraw_pending = true;
+    if (!state->frame_callback) redraw(state);
+}
+
+// Hover intent. While the menu waits for input, the submenus the pointer is
+// likely to open next are built, measured and rasterized ahead of time, so
+// opening one only copies its raster. Likely means the submenus of items
+// near the hovered one, those in the direction the pointer last moved
+// first. Each call prepares at most one panel, and the event loop only
+// makes it when nothing else is waiting and no frame is owed. Building and
+// measuring are quick and done here; the raster is drawn by raster_ahead
+// on its own thread, which gives it up as soon as input arrives.
+static const int hover_intent_range = 3;
+
+// Note a panel that is getting a raster, for release_closed_rasters
+static void hold_raster(wl_state *state, int p) {
+    std::vector<int>& held = state->raster_panels;
+    if (std::find(held.begin(), held.end(), p) == held.end()) held.push_back(p);
+}
+
+static bool submenu_prepared(wl_state *state, int32_t id) {
+    int p = state->menu.links[id].panel;
+    if (p < 0) return false;
+    const MenuPanel& panel = state->menu.panels[p];
+    return panel.raster && !panel.dirty && panel.raster_scale == state->chosen_scale;
+}
+
+// Returns false when there is nothing left to prepare
+static bool prepare_hover_intent(wl_state *state) {
+    Menu& menu = state->menu;
+    if (!state->text_ready || state->redraw_pending || menu.filter.panel >= 0) return false;
+    if (!state->pointer_inside || state->hovered_path.empty()) return false;
+    if (state->raster_ahead && state->raster_ahead->busy()) return false;
+    size_t level = state->hovered_path.size() - 1;
+    if (level >= state->drawn_panels.size()) return false;
+
+    const MenuPanel& panel = menu.panels[state->drawn_panels[level].panel];
+    int hovered = state->hovered_path.back();
+    for (int dir : { state->pointer_dy, -state->pointer_dy }) {
+        for (int step = 1; step <= hover_intent_range; ++step) {
+            int pos = hovered + dir * step;
+            if (pos < 0 || pos >= (int)panel.count) break;
+            int32_t id = menu.item(panel, pos);
+            if (!menu.has_submenu(id) || submenu_prepared(state, id)) continue;
+
+            TraceScope span("hover intent");
+            int sub = open_submenu(menu, id, state->pango, desc);
+            hold_raster(state, sub);
+            if (!state->raster_ahead) state->raster_ahead.reset(new RasterAhead());
+            state->raster_ahead->start(menu, sub, state->chosen_scale, desc);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether hover intent would prepare panel `p` from where the pointer is
+static bool hover_intent_candidate(wl_state *state, int p) {
+    const Menu& menu = state->menu;
+    if (state->hovered_path.empty()) return false;
+    size_t level = state->hovered_path.size() - 1;
+    if (level >= state->drawn_panels.size()) return false;
+    const MenuPanel& panel = menu.panels[state->drawn_panels[level].panel];
+    int hovered = state->hovered_path.back();
+    int32_t owner = menu.panels[p].owner;
+    for (int pos = std::max(0, hovered - hover_intent_range);
+            pos <= hovered + hover_intent_range && pos < (int)panel.count; ++pos) {
+        if (menu.item(panel, pos) == owner) return true;
+    }
+    return false;
+}
+
+// A raster is only worth its memory while its panel is open or about to
+// be. Once a frame is up, the rasters of panels closed since are freed,
+// other than those hover intent would prepare again right away, so the
+// daemon does not keep one for every submenu ever visited.
+static void release_closed_rasters(wl_state *state) {
+    for (const OpenPanel& open : state->drawn_panels) hold_raster(state, open.panel);
+    std::vector<int>& held = state->raster_panels;
+    size_t kept = 0;
+    for (int p : held) {
+        MenuPanel& panel = state->menu.panels[p];
+        if (!panel.raster) continue;
+        bool open = std::any_of(state->drawn_panels.begin(), state->drawn_panels.end(),
+                                [p](const OpenPanel& o) { return o.panel == p; });
+        if (!open && !hover_intent_candidate(state, p)) {
+            cairo_surface_destroy(panel.raster);
+            panel.raster = nullptr;
+            continue;
+        }
+        held[kept++] = p;
+    }
+    held.resize(kept);
+}
+
+// Keep a raster drawn ahead that is finished, and give up the one still
+// being drawn, before anything may change the menu
+static void settle_raster_ahead(wl_state *state) {
+    if (!state->raster_ahead) return;
+    state->rasterized_bytes += state->raster_ahead->take(state->menu);
+    state->raster_ahead->cancel();
+}
+
+// Everything the pointer handlers touch is sized to the menu depth up
+// front, and only grows when streamed lines nest deeper than before
+static void fit_menu_depth(wl_state *state) {
+    size_t depth = state->menu.depth;
+    if (depth <= state->panel_surfaces.size()) return;
+    state->hovered_path.reserve(depth);
+    state->hit_path.reserve(depth);
+    // Open panels and hover intent's picks, both before and after a frame
+    state->raster_panels.reserve(2 * (depth + 2 * hover_intent_range));
+    state->open_panels.reserve(depth);
+    state->drawn_panels.reserve(depth);
+    state->panel_surfaces.resize(depth);
+}
+
+// Add what the producer wrote since the last wakeup. Lines are parsed as
+// they arrive, but measuring and painting wait for the next frame.
+static bool read_more_input(wl_state *state, int fd) {
+    TraceScope span("parse");
+    bool more = read_menu(state->menu, fd);
+    fit_menu_depth(state);
+    if (state->menu.error) state->running = false;
+    if (state->menu.dirty) schedule_redraw(state);
+    return more;
+}
+
+// Connect and bind everything a menu needs. Outputs and the seat are bound
+// here too, but their events only arrive during the next dispatch.
+static bool connect_display(wl_state *state) {
+    state->display = wl_display_connect(nullptr);
+    if (!state->display) {
+        fprintf(stderr, "Failed to connect to Wayland display\n");
+        return false;
+    }
+
+    state->registry = wl_display_get_registry(state->display);
+    wl_registry_add_listener(state->registry, &registry_listener, state);
+    {
+        TraceScope span("registry roundtrip");
+        wl_display_roundtrip(state->display);
+    }
+
+    if (!state->compositor || !state->subcompositor || !state->shm || !state->layer_shell) {
+        fprintf(stderr, "Failed to bind required Wayland interfaces\n");
+        return false;
+    }
+
+    // Create a pointer for the background (click-away)
+    state->bg_pointer = wl_seat_get_pointer(state->seat);
+    wl_pointer_add_listener(state->bg_pointer, &bg_pointer_listener, state);
+    return true;
+}
+
+// Everything about one shown menu starts out fresh
+static void reset_popup(wl_state *state) {
+    state->running = true;
+    state->configured = false;
+    state->selected = -1;
+    state->width = min_width;
+    state->height = 100;
+    state->redraw_pending = false;
+    state->filter_tree = false;
+    state->filter_level = 0;
+    state->frame_damage.reserve(2);
+    state->layout_scale = 0; // a new menu has to be measured
+    state->preferred_scale = 0;
+}
+
+// The compositor's scale for the menu, which may change while it is up.
+// Until the first configure it is only noted, for the first frame to use.
+static void fractional_preferred_scale(void *data, struct wp_fractional_scale_v1 *, uint32_t scale) {
+    wl_state *state = static_cast<wl_state *>(data);
+    state->preferred_scale = scale;
+    if (!state->configured || state->chosen_scale == scale / 120.0) return;
+    state->chosen_scale = scale / 120.0;
+    for (auto& ps : state->panel_surfaces) {
+        if (ps.mapped) ps.stale = true;
+    }
+    if (state->text_ready) schedule_redraw(state);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+    .preferred_scale = fractional_preferred_scale,
+};
+
+// Set up both layers and wait until the menu layer is configured. Their
+// configures come after the output and seat events, so by then everything
+// needed for the first frame is in.
+static bool create_popup_surfaces(wl_state *state) {
+    state->chosen_output = nullptr;
+    if (!state->outputs_by_name.empty())
+        state->chosen_output = state->outputs_by_name.begin()->second.output;
+
+    // Create background layer (transparent/full screen)
+    state->bg_surface = wl_compositor_create_surface(state->compositor);
+    state->bg_layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+        state->layer_shell, state->bg_surface, nullptr,
+        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "menu-bg");
 
-        char* midtab = strchr(start, '\t');
-        if (midtab) {
-            // Split into label and output
-            *midtab = '\0';
-            item.label = std::string(start);
-            item.output = std::string(midtab + 1);
+    zwlr_layer_surface_v1_set_anchor(state->bg_layer_surface,
+        ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+        ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+        ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
+        ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+    zwlr_layer_surface_v1_set_keyboard_interactivity(state->bg_layer_surface, 0);
+    zwlr_layer_surface_v1_add_listener(state->bg_layer_surface, &bg_layer_surface_listener, state);
+
+    // The buffer is attached from the configure, once the size is known
+    wl_surface_commit(state->bg_surface);
+
+    state->surface = wl_compositor_create_surface(state->compositor);
+    state->panel_surfaces[0].surface = state->surface;
+    // Asked for before the first commit, so the preferred scale can come
+    // in along with the configure
+    if (state->fractional_scale_manager && state->viewporter) {
+        state->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+            state->fractional_scale_manager, state->surface);
+        wp_fractional_scale_v1_add_listener(state->fractional_scale, &fractional_scale_listener, state);
+    }
+
+    state->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
+        state->layer_shell, state->surface, state->chosen_output,
+        ZWLR_LAYER_SHELL_V1_LAYER_TOP, "menu");
+
+    zwlr_layer_surface_v1_set_size(state->layer_surface,
+        state->width / state->chosen_scale, state->height / state->chosen_scale);
+    zwlr_layer_surface_v1_set_anchor(state->layer_surface,
+        ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
+    // Keys go to the menu for as long as it is up
+    zwlr_layer_surface_v1_set_keyboard_interactivity(state->layer_surface, 1);
+    zwlr_layer_surface_v1_add_listener(state->layer_surface, &layer_surface_listener, state);
+    wl_surface_commit(state->surface);
+
+    TraceScope span("configure roundtrip");
+    while (state->running && !state->configured && wl_display_dispatch(state->display) != -1) {
+    }
+    if (!state->configured) {
+        fprintf(stderr, "Failed to configure layer surface\n");
+        return false;
+    }
+    if (!state->bg_buffer) {
+        fprintf(stderr, "Failed to create background buffer\n");
+        return false;
+    }
+
+    state->chosen_scale = 1;
+    if (state->preferred_scale) {
+        state->chosen_scale = state->preferred_scale / 120.0;
+    } else if (state->chosen_output) {
+        int scale = state->outputs_by_name.begin()->second.scale;
+        state->chosen_scale = scale > 0 ? scale : 1;
+    }
+    if (!state->fractional_scale)
+        wl_surface_set_buffer_scale(state->surface, state->chosen_scale);
+    return true;
+}
+
+// Wait on the display and, until it ends, the input together. When
+// nothing is waiting, hover intent gets one step at a time, and while a
+// raster is drawn ahead, its worker is waited on too.
+static void run_popup(wl_state *state, int input_fd, bool streaming) {
+    int display_fd = wl_display_get_fd(state->display);
+    bool idle_work = true;
+    while (state->running) {
+        while (wl_display_prepare_read(state->display) != 0)
+            wl_display_dispatch_pending(state->display);
+        wl_display_flush(state->display);
+
+        bool ahead = state->raster_ahead && state->raster_ahead->busy();
+        struct pollfd fds[3] = {
+            { display_fd, POLLIN, 0 },
+            { ahead ? state->raster_ahead->fd() : -1, POLLIN, 0 },
+            { streaming ? input_fd : -1, POLLIN, 0 },
+        };
+        int ready = poll(fds, 3, idle_work && !ahead ? 0 : -1);
+        if (ready < 0) {
+            wl_display_cancel_read(state->display);
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (ready == 0) {
+            wl_display_cancel_read(state->display);
+            idle_work = prepare_hover_intent(state);
+            continue;
+        }
+        if (!(fds[0].revents | fds[2].revents)) {
+            // Only the raster drawn ahead is done; on to the next one
+            wl_display_cancel_read(state->display);
+            state->rasterized_bytes += state->raster_ahead->take(state->menu);
+            idle_work = true;
+            continue;
+        }
+        settle_raster_ahead(state);
+        // What is likely next may have changed
+        idle_work = true;
+
+        if (fds[0].revents & (POLLERR | POLLHUP)) {
+            wl_display_cancel_read(state->display);
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (wl_display_read_events(state->display) < 0) break;
         } else {
-            item.label = std::string(start);
+            wl_display_cancel_read(state->display);
         }
+        if (wl_display_dispatch_pending(state->display) < 0) break;
 
-        while ((int)stack.size() <= tabs)
-            stack.push_back(&stack.back()->items.back().submenu);
+        if (streaming && (fds[2].revents & (POLLIN | POLLHUP | POLLERR)))
+            streaming = read_more_input(state, input_fd);
+    }
+    settle_raster_ahead(state);
+}
+
+// With --stats, where the memory of a menu went, printed to stderr as it
+// closes. Pango keeps its layouts and font data on the heap, so what the
+// heap holds beyond the menu's own arrays is mostly theirs.
+static bool print_stats_on_exit = false;
+
+static void print_stats(wl_state *state) {
+    MenuStats stats;
+    menu_stats(state->menu, stats);
+    auto line = [](const char *name, double bytes) {
+        fprintf(stderr, "rmenu: %-20s %12.1f KiB\n", name, bytes / 1024);
+    };
+    line("input (heap)", stats.input_heap);
+    line("input (mapped)", stats.input_mapped);
+    line("items", stats.item_bytes);
+    line("panels", stats.panel_bytes);
+    line("filter", stats.filter_bytes);
+    line("panel rasters", stats.raster_bytes);
+
+    size_t cache_keys = 0;
+    for (const auto& entry : state->label_cache.layouts) cache_keys += entry.first.capacity();
+    line("label cache keys", cache_keys);
+
+    // With a viewport the click-away layer is one stretched pixel, and a
+    // single-pixel buffer has no shm behind it at all
+    size_t bg_bytes = 0;
+    if (state->bg_buffer && !(state->viewporter && state->single_pixel))
+        bg_bytes = state->viewporter ? 4 : (size_t)state->bg_width * state->bg_height * 4;
+    line("click-away buffer", bg_bytes);
+
+    size_t shm_current = 0;
+    for (const auto& ps : state->panel_surfaces) shm_current += ps.pool.size;
+    line("shm (current)", shm_current);
+    line("shm (peak)", state->shm_peak);
+
+    // mallinfo2 is glibc's, from 2.33 on; elsewhere the heap goes unreported
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 heap = mallinfo2();
+    line("heap in use", heap.uordblks);
+#endif
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) line("peak RSS", usage.ru_maxrss * 1024.0);
+
+    fprintf(stderr, "rmenu: %zu shaped labels, %zu in label cache, %zu panel rasters\n",
+            stats.layouts, state->label_cache.layouts.size(), stats.rasters);
+    for (size_t depth = 0; depth < stats.items_per_depth.size(); ++depth)
+        fprintf(stderr, "rmenu: depth %zu: %zu items\n", depth, stats.items_per_depth[depth]);
+    if (stats.unbuilt_submenus)
+        fprintf(stderr, "rmenu: %zu submenus never opened, not built\n", stats.unbuilt_submenus);
+    if (stats.largest_panel >= 0) {
+        const MenuPanel& panel = state->menu.panels[stats.largest_panel];
+        const MenuText& owner = state->menu.text[panel.owner];
+        fprintf(stderr, "rmenu: largest panel: %u items, %dx%d, under \"%.*s\"\n", panel.count,
+                panel.bounds.w, panel.bounds.h, panel.owner ? (int)owner.label_len : 4,
+                panel.owner ? state->menu.label(panel.owner) : "root");
+    }
+}
 
-        while ((int)stack.size() > tabs + 1)
-            stack.pop_back();
+// Take down one menu's surfaces and model; the connection stays
+static void destroy_popup(wl_state *state) {
+    if (state->raster_ahead) state->raster_ahead->cancel();
+    if (state->frame_callback) wl_callback_destroy(state->frame_callback);
+    state->frame_callback = nullptr;
+    for (auto& ps : state->panel_surfaces) {
+        shm_pool_destroy(ps.pool);
+        if (ps.viewport) wp_viewport_destroy(ps.viewport);
+        if (ps.subsurface) wl_subsurface_destroy(ps.subsurface);
+        if (ps.subsurface && ps.surface) wl_surface_destroy(ps.surface);
+    }
+    state->panel_surfaces.clear();
+    // Nothing the pointer or the last frame pointed at is left
+    state->pointer_level = 0;
+    state->pointer_inside = false;
+    state->pointer_entered = false;
+    state->pointer_moved = false;
+    state->pointer_scroll = 0;
+    state->hovered_path.clear();
+    state->drawn_panels.clear();
+    state->open_panels.clear();
+    state->raster_panels.clear();
+    if (state->fractional_scale) wp_fractional_scale_v1_destroy(state->fractional_scale);
+    if (state->layer_surface) zwlr_layer_surface_v1_destroy(state->layer_surface);
+    if (state->surface) wl_surface_destroy(state->surface);
+    state->fractional_scale = nullptr;
+    state->layer_surface = nullptr;
+    state->surface = nullptr;
+    if (state->bg_viewport) wp_viewport_destroy(state->bg_viewport);
+    if (state->bg_buffer) wl_buffer_destroy(state->bg_buffer);
+    if (state->bg_layer_surface) zwlr_layer_surface_v1_destroy(state->bg_layer_surface);
+    if (state->bg_surface) wl_surface_destroy(state->bg_surface);
+    state->bg_viewport = nullptr;
+    state->bg_buffer = nullptr;
+    state->bg_layer_surface = nullptr;
+    state->bg_surface = nullptr;
+    state->bg_width = 0;
+    state->bg_height = 0;
+    free_menu(state->menu);
+    state->menu = Menu();
+}
 
-        stack.back()->items.push_back(item);
-        prev_was_empty = false;
+static void disconnect_display(wl_state *state) {
+    state->raster_pool.reset();
+    state->raster_ahead.reset();
+    clear_label_cache(state->label_cache);
+    if (state->pango) g_object_unref(state->pango);
+    if (state->font_map) g_object_unref(state->font_map);
+    if (desc) pango_font_description_free(desc);
+    if (state->bg_pointer) wl_pointer_destroy(state->bg_pointer);
+    if (state->pointer) wl_pointer_destroy(state->pointer);
+    if (state->keyboard) wl_keyboard_destroy(state->keyboard);
+    if (state->key_state) xkb_state_unref(state->key_state);
+    if (state->keymap) xkb_keymap_unref(state->keymap);
+    if (state->xkb) xkb_context_unref(state->xkb);
+    if (state->seat) wl_seat_destroy(state->seat);
+    if (state->layer_shell) zwlr_layer_shell_v1_destroy(state->layer_shell);
+    if (state->subcompositor) wl_subcompositor_destroy(state->subcompositor);
+    if (state->compositor) wl_compositor_destroy(state->compositor);
+    if (state->viewporter) wp_viewporter_destroy(state->viewporter);
+    if (state->single_pixel) wp_single_pixel_buffer_manager_v1_destroy(state->single_pixel);
+    if (state->fractional_scale_manager) wp_fractional_scale_manager_v1_destroy(state->fractional_scale_manager);
+    if (state->shm) wl_shm_destroy(state->shm);
+    for (auto& pair : state->outputs_by_name) {
+        if (pair.second.output) wl_output_destroy(pair.second.output);
     }
+    if (state->registry) wl_registry_destroy(state->registry);
+    if (state->display) wl_display_disconnect(state->display);
 }
 
-int main() {
+// One menu, read from stdin, for the life of the process. With a trace
+// path, the pointer events of the session are recorded to it.
+static int run_standalone(const char *record) {
+    StartupTimer timer;
     wl_state state = {};
-    state.running = true;
-    state.width = min_width;
-    state.height = 100;
+    reset_popup(&state);
     state.chosen_output = nullptr;
     state.chosen_scale = 1;
 
-    parse_menu(&state);
+    // A file is complete and read at once. Anything else is streamed: the
+    // menu shows as soon as it has an item, and later lines are added to it
+    // while it is up.
+    struct stat st;
+    bool streaming = !(fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode));
+    {
+        TraceScope span("parse");
+        if (streaming) {
+            while (streaming && state.menu.empty())
+                streaming = read_menu(state.menu, STDIN_FILENO);
+        } else {
+            parse_menu(state.menu, STDIN_FILENO);
+        }
+    }
 
+    if (state.menu.error) {
+        fprintf(stderr, "%s\n", state.menu.error);
+        return 1;
+    }
     if (state.menu.empty()) {
         fprintf(stderr, "No menu items provided on stdin\n");
         return 1;
     }
 
-    state.display = wl_display_connect(nullptr);
-    if (!state.display) {
-        fprintf(stderr, "Failed to connect to Wayland display\n");
+    fit_menu_depth(&state);
+    timer.phase("read input");
+
+    // The menu and text state are the text thread's until it is joined
+    double text_ms = 0;
+    std::thread text_thread(warm_up_text, &state, &text_ms);
+
+    bool ok = connect_display(&state);
+    timer.phase("connect");
+    if (ok) {
+        ok = create_popup_surfaces(&state);
+        timer.phase("configure");
+    }
+
+    text_thread.join();
+    state.text_ready = true;
+    if (!ok) return 1;
+    set_menu_max_height(state.menu, state.bg_height);
+    timer.phase("text wait");
+    timer.report("text (thread)", text_ms);
+
+    redraw(&state);
+    if (state.redraw_pending) {
+        fprintf(stderr, "Failed to create buffer\n");
         return 1;
     }
+    timer.phase("first frame");
+    timer.total();
 
-    state.registry = wl_display_get_registry(state.display);
-    wl_registry_add_listener(state.registry, &registry_listener, &state);
-    wl_display_roundtrip(state.display);
-    wl_display_roundtrip(state.display);
+    if (record) {
+        state.trace = fopen(record, "w");
+        if (!state.trace) perror(record);
+        state.trace_start = now_ms();
+    }
+    run_popup(&state, STDIN_FILENO, streaming);
+    if (state.trace) fclose(state.trace);
+
+    int status = 0;
+    if (state.selected >= 0) {
+        print_item(state.menu, state.selected, stdout);
+    } else if (state.menu.error) {
+        fprintf(stderr, "%s\n", state.menu.error);
+        status = 1;
+    }
+    if (print_stats_on_exit) print_stats(&state);
+    destroy_popup(&state);
+    disconnect_display(&state);
+    return status;
+}
 
-    if (!state.outputs_by_name.empty()) {
-        auto it = state.outputs_by_name.begin();
-        state.chosen_output = it->second.output;
-        state.chosen_scale = (it->second.scale > 0) ? it->second.scale : 1;
-    } else {
-        state.chosen_scale = 1;
+// One daemon per Wayland display, in the user's runtime directory
+static bool daemon_address(struct sockaddr_un& addr) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    const char *display = getenv("WAYLAND_DISPLAY");
+    if (!runtime) return false;
+    if (!display) display = "wayland-0";
+    const char *slash = strrchr(display, '/');
+    if (slash) display = slash + 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/rmenu-%s.sock", runtime, display);
+    return n > 0 && (size_t)n < sizeof(addr.sun_path);
+}
+
+static int connect_daemon() {
+    struct sockaddr_un addr;
+    if (!daemon_address(addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    if (!state.compositor || !state.shm || !state.layer_shell) {
-        fprintf(stderr, "Failed to bind required Wayland interfaces\n");
+// Replies from the daemon start with one status byte
+static const char reply_selected = 'S';
+static const char reply_dismissed = 'D';
+static const char reply_error = 'E';
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// The client side of daemon mode. It only relays: stdin goes to the daemon
+// as it arrives, so streaming works as it does locally, and the reply
+// becomes stdout and the exit status.
+static int run_client(int sock) {
+    std::vector<char> reply;
+    char buf[65536];
+    bool forwarding = true;
+    while (true) {
+        struct pollfd fds[2] = {
+            { sock, POLLIN, 0 },
+            { STDIN_FILENO, POLLIN, 0 },
+        };
+        if (poll(fds, forwarding ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+
+        if (forwarding && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            bool sent = n > 0 && send_all(sock, buf, n);
+            if (!sent && !(n < 0 && errno == EINTR)) {
+                // End of input, or the daemon stopped listening
+                shutdown(sock, SHUT_WR);
+                forwarding = false;
+            }
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(sock, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            reply.insert(reply.end(), buf, buf + n);
+        }
+    }
+    close(sock);
+
+    if (reply.empty()) {
+        fprintf(stderr, "rmenu daemon closed the connection\n");
         return 1;
     }
+    if (reply[0] == reply_selected) {
+        fwrite(reply.data() + 1, 1, reply.size() - 1, stdout);
+        fflush(stdout);
+        return 0;
+    }
+    if (reply[0] == reply_error) {
+        fwrite(reply.data() + 1, 1, reply.size() - 1, stderr);
+        return 1;
+    }
+    return 0;
+}
 
-    // Create background layer (transparent/full screen)
-    state.bg_surface = wl_compositor_create_surface(state.compositor);
-    state.bg_layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-        state.layer_shell, state.bg_surface, nullptr,
-        ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY, "menu-bg");
+// Show one menu for a client of the daemon, reading it from the socket
+static void serve_client(wl_state *state, int client) {
+    reset_popup(state);
+    state->menu.label_cache = &state->label_cache;
 
-    zwlr_layer_surface_v1_set_anchor(state.bg_layer_surface,
-        ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-        ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-        ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
-        ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-    zwlr_layer_surface_v1_set_keyboard_interactivity(state.bg_layer_surface, 0);
-    zwlr_layer_surface_v1_add_listener(state.bg_layer_surface, &bg_layer_surface_listener, &state);
+    bool streaming = true;
+    {
+        TraceScope span("parse");
+        while (streaming && state->menu.empty())
+            streaming = read_menu(state->menu, client);
+    }
 
-    wl_surface_commit(state.bg_surface);
-    wl_display_roundtrip(state.display);
+    bool shown = false;
+    if (!state->menu.error && !state->menu.empty()) {
+        fit_menu_depth(state);
+        if (create_popup_surfaces(state)) {
+            set_menu_max_height(state->menu, state->bg_height);
+            redraw(state);
+            shown = !state->redraw_pending;
+        }
+    }
+    if (shown)
+        run_popup(state, client, streaming);
+
+    FILE *out = fdopen(dup(client), "w");
+    if (out) {
+        if (state->selected >= 0) {
+            fputc(reply_selected, out);
+            print_item(state->menu, state->selected, out);
+        } else if (state->menu.error) {
+            fprintf(out, "%c%s\n", reply_error, state->menu.error);
+        } else if (state->menu.empty()) {
+            fprintf(out, "%cNo menu items provided on stdin\n", reply_error);
+        } else if (!shown) {
+            fprintf(out, "%cFailed to show menu\n", reply_error);
+        } else {
+            fputc(reply_dismissed, out);
+        }
+        fclose(out);
+    }
+    if (print_stats_on_exit) print_stats(state);
+    destroy_popup(state);
+    trace_write();
+    trace_clear();
+}
 
-    // Use a reasonable default size for now; you may want to track this from configure
-    state.bg_buffer = create_transparent_buffer(&state, 1920, 1080);
-    if (!state.bg_buffer) {
-        fprintf(stderr, "Failed to create background buffer\n");
+// Keep the connection, bound globals, fonts and shaped labels from one
+// menu to the next, and show menus for clients one after another. Clients
+// that connect while a menu is up wait in the listen backlog.
+static int run_daemon() {
+    struct sockaddr_un addr;
+    if (!daemon_address(addr)) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+        return 1;
+    }
+    int probe = connect_daemon();
+    if (probe >= 0) {
+        close(probe);
+        fprintf(stderr, "rmenu daemon is already running\n");
         return 1;
     }
-    wl_surface_attach(state.bg_surface, state.bg_buffer, 0, 0);
-    wl_surface_commit(state.bg_surface);
 
-    // Create a pointer for the background (click-away)
-    state.bg_pointer = wl_seat_get_pointer(state.seat);
-    wl_pointer_add_listener(state.bg_pointer, &bg_pointer_listener, &state);
+    wl_state state = {};
+    state.chosen_scale = 1;
+    if (!connect_display(&state)) return 1;
+
+    // Load fonts now rather than on the first menu
+    desc = pango_font_description_from_string(font);
+    update_layouts(&state, 1);
+    PangoLayout *sample = pango_layout_new(state.pango);
+    pango_layout_set_font_description(sample, desc);
+    pango_layout_set_text(sample, "rmenu", -1);
+    int w, h;
+    pango_layout_get_pixel_size(sample, &w, &h);
+    g_object_unref(sample);
+    state.text_ready = true;
+
+    // A client that goes away must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+
+    unlink(addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listener, 16) < 0) {
+        perror("rmenu daemon socket");
+        disconnect_display(&state);
+        return 1;
+    }
 
-    state.surface = wl_compositor_create_surface(state.compositor);
-    wl_surface_set_buffer_scale(state.surface, state.chosen_scale);
+    int display_fd = wl_display_get_fd(state.display);
+    bool alive = true;
+    while (alive) {
+        // Keep up with output and seat changes between menus
+        while (wl_display_prepare_read(state.display) != 0)
+            wl_display_dispatch_pending(state.display);
+        wl_display_flush(state.display);
+
+        struct pollfd fds[2] = {
+            { display_fd, POLLIN, 0 },
+            { listener, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            wl_display_cancel_read(state.display);
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP)) {
+            wl_display_cancel_read(state.display);
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            alive = wl_display_read_events(state.display) >= 0;
+        } else {
+            wl_display_cancel_read(state.display);
+        }
+        if (!alive || wl_display_dispatch_pending(state.display) < 0) break;
 
-    state.layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-        state.layer_shell, state.surface, state.chosen_output,
-        ZWLR_LAYER_SHELL_V1_LAYER_TOP, "menu");
+        if (fds[1].revents & POLLIN) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            serve_client(&state, client);
+            close(client);
+        }
+    }
 
-    zwlr_layer_surface_v1_set_size(state.layer_surface,
-        state.width / state.chosen_scale, state.height / state.chosen_scale);
-    zwlr_layer_surface_v1_set_anchor(state.layer_surface,
-        ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT);
-    zwlr_layer_surface_v1_add_listener(state.layer_surface, &layer_surface_listener, &state);
+    close(listener);
+    unlink(addr.sun_path);
+    disconnect_display(&state);
+    return 1;
+}
 
-    wl_surface_commit(state.surface);
-    wl_display_roundtrip(state.display);
+// Turn the menu on stdin into a compiled image on stdout, with every
+// submenu built and every label measured at the given scale
+static int run_compile(double scale) {
+    wl_state state = {};
+    parse_menu(state.menu, STDIN_FILENO);
+    if (state.menu.error) {
+        fprintf(stderr, "%s\n", state.menu.error);
+        return 1;
+    }
+    if (state.menu.empty()) {
+        fprintf(stderr, "No menu items provided on stdin\n");
+        return 1;
+    }
 
     desc = pango_font_description_from_string(font);
+    update_layouts(&state, scale);
+    for (size_t id = 1; id < state.menu.text.size(); ++id) {
+        if (state.menu.has_submenu(id))
+            open_submenu(state.menu, id, state.pango, desc);
+    }
 
-    state.buffer = create_buffer(&state);
-    if (!state.buffer) {
-        fprintf(stderr, "Failed to create buffer\n");
+    int status = 0;
+    if (!write_menu_image(state.menu, font, scale, stdout)) {
+        perror("rmenu: writing menu image");
+        status = 1;
+    }
+    free_menu(state.menu);
+    clear_label_cache(state.label_cache);
+    return status;
+}
+
+#ifdef RMENU_REPLAY
+// rmenu-replay: pointer traces played through the real handlers and frame
+// path, with the compositor replaced by the stand-in in replay.cc. Time
+// follows the trace, plus whatever the handlers and painting actually
+// take, and the display refreshes at 60 Hz on that clock.
+
+static const double replay_refresh_ms = 1000.0 / 60;
+// Input after a pause this long starts a new burst
+static const double replay_burst_gap_ms = 100;
+
+struct TraceEvent {
+    double ms;
+    char op;
+    int args[3];
+};
+
+static bool read_trace(const char *path, std::vector<TraceEvent>& events) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        TraceEvent ev = {};
+        if (sscanf(line, "%lf %c %d %d %d", &ev.ms, &ev.op, &ev.args[0], &ev.args[1], &ev.args[2]) >= 2)
+            events.push_back(ev);
+    }
+    fclose(f);
+    return true;
+}
+
+// Without a trace: the pointer comes in over the root panel and sweeps down
+// it and back up at a pointer frame every 8 ms, opening every submenu on
+// the way, then leaves
+static void synthetic_trace(const Menu& menu, std::vector<TraceEvent>& events) {
+    const Rect& b = menu.panels[0].bounds;
+    int x = wl_fixed_from_int(b.w / 2);
+    double ms = 0;
+    auto frame = [&] { events.push_back({ ms, 'f', {} }); ms += 8; };
+    events.push_back({ ms, 'e', { 0, x, wl_fixed_from_int(1) } });
+    frame();
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int y = 1; y < b.h; y += 4) {
+            int at = pass ? b.h - y : y;
+            events.push_back({ ms, 'm', { x, wl_fixed_from_int(at) } });
+            frame();
+        }
+    }
+    events.push_back({ ms, 'l', {} });
+    frame();
+}
+
+static double replay_percentile(std::vector<double> values, int p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * p / 100)];
+}
+
+static int run_replay(int argc, char **argv) {
+    const char *path = nullptr;
+    double scale = 1;
+    int output_height = 1080;
+    bool json = false;
+    bool check_alloc = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--check-alloc") == 0) check_alloc = true;
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) output_height = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !path) path = argv[i];
+        else {
+            fprintf(stderr, "usage: rmenu-replay [--scale S] [--height H] [--json] [--check-alloc] [trace] < menu\n");
+            return 2;
+        }
+    }
+    if (scale <= 0) scale = 1;
+
+    wl_state state = {};
+    reset_popup(&state);
+    state.chosen_scale = scale;
+    parse_menu(state.menu, STDIN_FILENO);
+    if (state.menu.error || state.menu.empty()) {
+        fprintf(stderr, "%s\n", state.menu.error ? state.menu.error : "No menu items provided on stdin");
         return 1;
     }
+    fit_menu_depth(&state);
+    double text_ms = 0;
+    warm_up_text(&state, &text_ms);
+    state.text_ready = true;
+    set_menu_max_height(state.menu, output_height);
+
+    // What connecting and configuring would have left behind
+    state.compositor = (struct wl_compositor *)replay_create_proxy(&wl_compositor_interface);
+    state.subcompositor = (struct wl_subcompositor *)replay_create_proxy(&wl_subcompositor_interface);
+    state.shm = (struct wl_shm *)replay_create_proxy(&wl_shm_interface);
+    if (scale != floor(scale)) {
+        state.viewporter = (struct wp_viewporter *)replay_create_proxy(&wp_viewporter_interface);
+        state.fractional_scale = (struct wp_fractional_scale_v1 *)
+            replay_create_proxy(&wp_fractional_scale_v1_interface);
+    }
+    state.surface = (struct wl_surface *)replay_create_proxy(&wl_surface_interface);
+    state.panel_surfaces[0].surface = state.surface;
+    replay_set_root(state.surface);
+    state.configured = true;
+    // Pointer events on surfaces that are not menu panels
+    struct wl_surface *elsewhere = (struct wl_surface *)replay_create_proxy(&wl_surface_interface);
+
+    std::vector<TraceEvent> events;
+    if (path && !read_trace(path, events)) {
+        perror(path);
+        return 1;
+    }
+    redraw(&state);
+    if (!path) synthetic_trace(state.menu, events);
+    // With --check-alloc the trace is played twice. The first time builds,
+    // measures and draws whatever it reaches; the second time, pointer
+    // motion and frames must not call operator new.
+    size_t checked_from = events.size();
+    if (check_alloc && !events.empty()) {
+        double offset = events.back().ms + replay_burst_gap_ms;
+        for (size_t i = 0; i < checked_from; ++i) {
+            events.push_back(events[i]);
+            events.back().ms += offset;
+        }
+    }
+    size_t checked_events = 0;
+    size_t allocations = 0;
+    const std::vector<ReplayCommit>& commits = replay_commits();
+    size_t first_commit = commits.size();
+    // Raster drawn for each commit, counting what hover intent prepared
+    // since the one before
+    std::vector<double> rasterized;
+    size_t rasterized_mark = state.rasterized_bytes;
+
+    double clock = 0;
+    double next_vblank = replay_refresh_ms;
+    std::vector<double> waiting;   // inputs whose change is not on screen yet
+    std::vector<double> latencies; // from an input to the commit that showed it
+    std::vector<int> burst_frames;
+    size_t unchanged = 0;
+    double last_input = -replay_burst_gap_ms;
+
+    // Run one step at the current clock, which then advances by the time
+    // it took. A commit made during it shows everything still waiting.
+    auto step = [&](auto work) {
+        size_t before = commits.size();
+        double start = now_ms();
+        work();
+        clock += now_ms() - start;
+        if (commits.size() == before) return;
+        rasterized.resize(rasterized.size() + commits.size() - before - 1, 0);
+        rasterized.push_back(state.rasterized_bytes - rasterized_mark);
+        rasterized_mark = state.rasterized_bytes;
+        for (double t : waiting) latencies.push_back(clock - t);
+        waiting.clear();
+        if (!burst_frames.empty()) burst_frames.back() += commits.size() - before;
+    };
+    auto vblanks_until = [&](double t) {
+        while (next_vblank <= t) {
+            clock = std::max(clock, next_vblank);
+            step([&] {
+                settle_raster_ahead(&state);
+                replay_vblank((uint32_t)next_vblank);
+            });
+            next_vblank += replay_refresh_ms;
+        }
+    };
 
-    wl_surface_attach(state.surface, state.buffer, 0, 0);
-    wl_surface_damage_buffer(state.surface, 0, 0, state.width, state.height);
-    wl_surface_commit(state.surface);
-
-    while (state.running && wl_display_dispatch(state.display) != -1) {
-        // Event loop
-    }
-
-    pango_font_description_free(desc);
-    if (state.bg_pointer) wl_pointer_destroy(state.bg_pointer);
-    if (state.bg_buffer) wl_buffer_destroy(state.bg_buffer);
-    if (state.bg_layer_surface) zwlr_layer_surface_v1_destroy(state.bg_layer_surface);
-    if (state.bg_surface) wl_surface_destroy(state.bg_surface);
-    if (state.pointer) wl_pointer_destroy(state.pointer);
-    if (state.seat) wl_seat_destroy(state.seat);
-    if (state.buffer) wl_buffer_destroy(state.buffer);
-    if (state.layer_surface) zwlr_layer_surface_v1_destroy(state.layer_surface);
-    if (state.surface) wl_surface_destroy(state.surface);
-    if (state.layer_shell) zwlr_layer_shell_v1_destroy(state.layer_shell);
-    if (state.compositor) wl_compositor_destroy(state.compositor);
-    if (state.shm) wl_shm_destroy(state.shm);
-    for (auto& pair : state.outputs_by_name) {
-        if (pair.second.output) wl_output_destroy(pair.second.output);
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent& ev = events[i];
+        if (!state.running) break;
+        vblanks_until(std::max(clock, ev.ms));
+        // Idle until the event comes, as in run_popup. A raster drawn ahead
+        // is given up if it is not done by then.
+        bool idle_work = true;
+        while (idle_work && clock < ev.ms) {
+            step([&] { idle_work = prepare_hover_intent(&state); });
+            if (!state.raster_ahead || !state.raster_ahead->busy()) continue;
+            double start = now_ms();
+            bool done = state.raster_ahead->wait(ev.ms - clock);
+            clock += now_ms() - start;
+            if (!done) break;
+            state.rasterized_bytes += state.raster_ahead->take(state.menu);
+        }
+        clock = std::max(clock, ev.ms);
+        if (ev.ms - last_input >= replay_burst_gap_ms) burst_frames.push_back(0);
+        last_input = ev.ms;
+
+        size_t before = commits.size();
+        bool checked = i >= checked_from && (ev.op == 'm' || ev.op == 'f');
+        step([&] {
+            // A frame due right away is drawn after the handler returns,
+            // so that only the handler is counted
+            settle_raster_ahead(&state);
+            struct wl_callback *owed = state.frame_callback;
+            if (checked && !owed) state.frame_callback = reinterpret_cast<struct wl_callback *>(elsewhere);
+            size_t allocated = replay_allocations();
+            switch (ev.op) {
+            case 'e': {
+                int level = ev.args[0];
+                struct wl_surface *surface = level >= 0 && level < (int)state.panel_surfaces.size() &&
+                    state.panel_surfaces[level].surface ? state.panel_surfaces[level].surface : elsewhere;
+                pointer_enter(&state, nullptr, 0, surface, ev.args[1], ev.args[2]);
+                break;
+            }
+            case 'l': pointer_leave(&state, nullptr, 0, nullptr); break;
+            case 'm': pointer_motion(&state, nullptr, 0, ev.args[0], ev.args[1]); break;
+            case 'b': pointer_button(&state, nullptr, 0, 0, ev.args[0], ev.args[1]); break;
+            case 'a': pointer_axis(&state, nullptr, 0, ev.args[0], ev.args[1]); break;
+            case 'f': pointer_frame(&state, nullptr); break;
+            }
+            if (!checked) return;
+            checked_events++;
+            allocations += replay_allocations() - allocated;
+            if (!owed) {
+                state.frame_callback = nullptr;
+                if (state.redraw_pending) redraw(&state);
+            }
+        });
+        // Shown right away, or with the frame that is owed
+        if (commits.size() > before) latencies.push_back(clock - ev.ms);
+        else if (state.redraw_pending) waiting.push_back(ev.ms);
+        else unchanged++;
     }
-    if (state.registry) wl_registry_destroy(state.registry);
-    if (state.display) wl_display_disconnect(state.display);
-    return 0;
+    // Let the last frames out
+    for (int i = 0; i < 8 && (state.redraw_pending || !waiting.empty()); ++i)
+        vblanks_until(next_vblank);
+
+    std::vector<double> bytes;
+    for (size_t i = first_commit; i < commits.size(); ++i)
+        bytes.push_back(commits[i].damaged_bytes);
+    double total_bytes = 0;
+    for (double b : bytes) total_bytes += b;
+    int max_frames = 0;
+    double total_frames = 0;
+    for (int f : burst_frames) {
+        max_frames = std::max(max_frames, f);
+        total_frames += f;
+    }
+    double mean_frames = burst_frames.empty() ? 0 : total_frames / burst_frames.size();
+    double mean_bytes = bytes.empty() ? 0 : total_bytes / bytes.size();
+    double total_rasterized = 0;
+    for (double b : rasterized) total_rasterized += b;
+    double mean_rasterized = rasterized.empty() ? 0 : total_rasterized / rasterized.size();
+
+    // Latency buckets in ms, doubling; the last one takes everything longer
+    static const double bounds[] = { 1, 2, 4, 8, 16, 32, 64 };
+    const size_t nbuckets = sizeof(bounds) / sizeof(bounds[0]) + 1;
+    size_t histogram[nbuckets] = {};
+    for (double l : latencies) {
+        size_t b = 0;
+        while (b + 1 < nbuckets && l >= bounds[b]) ++b;
+        histogram[b]++;
+    }
+
+    if (json) {
+        printf("{\"events\": %zu, \"bursts\": %zu, \"commits\": %zu, \"scale\": %g, "
+               "\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"histogram\": [",
+               events.size(), burst_frames.size(), bytes.size(), scale,
+               replay_percentile(latencies, 50), replay_percentile(latencies, 99),
+               replay_percentile(latencies, 100));
+        for (size_t b = 0; b < nbuckets; ++b) printf("%s%zu", b ? ", " : "", histogram[b]);
+        printf("]}, \"unchanged_inputs\": %zu, \"frames_per_burst\": {\"mean\": %.2f, \"max\": %d}, "
+               "\"bytes_per_commit\": {\"mean\": %.0f, \"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f}, "
+               "\"rasterized_per_commit\": {\"mean\": %.0f, \"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f}}\n",
+               unchanged, mean_frames, max_frames, mean_bytes, replay_percentile(bytes, 50),
+               replay_percentile(bytes, 99), replay_percentile(bytes, 100), mean_rasterized,
+               replay_percentile(rasterized, 50), replay_percentile(rasterized, 99),
+               replay_percentile(rasterized, 100));
+    } else {
+        printf("%zu events in %zu bursts, %zu commits, scale %g\n",
+               events.size(), burst_frames.size(), bytes.size(), scale);
+        printf("input to commit: p50 %.3f ms, p99 %.3f ms, max %.3f ms; %zu inputs changed nothing\n",
+               replay_percentile(latencies, 50), replay_percentile(latencies, 99),
+               replay_percentile(latencies, 100), unchanged);
+        for (size_t b = 0; b < nbuckets; ++b) {
+            if (b + 1 < nbuckets) printf("  < %4g ms %8zu\n", bounds[b], histogram[b]);
+            else printf("  >= %3g ms %8zu\n", bounds[b - 1], histogram[b]);
+        }
+        printf("frames per burst: mean %.2f, max %d\n", mean_frames, max_frames);
+        printf("bytes per commit: mean %.0f, p50 %.0f, p99 %.0f, max %.0f\n", mean_bytes,
+               replay_percentile(bytes, 50), replay_percentile(bytes, 99), replay_percentile(bytes, 100));
+        printf("rasterized per commit: mean %.0f, p50 %.0f, p99 %.0f, max %.0f\n", mean_rasterized,
+               replay_percentile(rasterized, 50), replay_percentile(rasterized, 99),
+               replay_percentile(rasterized, 100));
+    }
+
+    if (check_alloc) {
+        fprintf(stderr, "%zu allocations in %zu pointer motion and frame events\n",
+                allocations, checked_events);
+    }
+
+    wl_surface_destroy(elsewhere);
+    destroy_popup(&state);
+    disconnect_display(&state);
+    return check_alloc && (allocations || !checked_events) ? 1 : 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+    trace_init();
+#ifdef RMENU_REPLAY
+    return run_replay(argc, argv);
+#endif
+    // --stats can be given along with any of the options below
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--stats") == 0) print_stats_on_exit = true;
+        else argv[kept++] = argv[i];
+    }
+    argc = kept;
+    argv[argc] = nullptr;
+
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0)
+        return run_daemon();
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0)
+        return run_compile(argc > 2 && atof(argv[2]) > 0 ? atof(argv[2]) : 1);
+    // Recording needs the session in this process
+    if (argc > 2 && strcmp(argv[1], "--record") == 0)
+        return run_standalone(argv[2]);
+
+    // Hand the menu to a running daemon if there is one, unless its
+    // memory is to be reported here or it is a compiled image, which the
+    // daemon would read as text
+    bool local = print_stats_on_exit || is_menu_image(STDIN_FILENO);
+    int sock = local ? -1 : connect_daemon();
+    if (sock >= 0)
+        return run_client(sock);
+    return run_standalone(nullptr);
 }
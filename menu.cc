@@ -0,0 +1,1150 @@
+extern "C" {
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+#include <algorithm>
+#include "menu.h"
+#include "config.h"
+
+Rect Menu::item_box(const MenuPanel& panel, size_t pos) const {
+    int32_t id = item(panel, pos);
+    int h = separator[id] ? separator_size : button_height;
+    return { panel.bounds.x, item_y[id] - panel.scroll, panel.bounds.w, h };
+}
+
+static int row_height(const Menu& menu, int32_t id) {
+    return (menu.separator[id] ? separator_size : button_height) + button_spacing;
+}
+
+// Positions of the items at least partly inside the panel's window. Item
+// y positions grow down the run, so both ends are binary searches.
+static void visible_items(const Menu& menu, const MenuPanel& panel, size_t& begin, size_t& end) {
+    const int32_t *run = menu.panel_items.data() + panel.first;
+    int top = panel.bounds.y + panel.scroll;
+    int bottom = top + panel.bounds.h;
+    const int32_t *first = std::upper_bound(run, run + panel.count, top,
+        [&menu](int y, int32_t id) { return y < menu.item_y[id]; });
+    if (first != run) --first;
+    const int32_t *last = std::lower_bound(first, run + panel.count, bottom,
+        [&menu](int32_t id, int y) { return menu.item_y[id] < y; });
+    begin = first - run;
+    end = last - run;
+}
+
+static const size_t input_block = 1 << 20;
+
+static int32_t append_item(Menu& menu, int32_t parent,
+                           const char *label, size_t label_len,
+                           const char *output, size_t output_len,
+                           bool is_separator) {
+    int32_t id = menu.text.size();
+    MenuText text;
+    text.label = label - menu.input;
+    text.label_len = label_len;
+    text.output = output - menu.input;
+    text.output_len = output_len;
+
+    menu.text.push_back(text);
+    menu.links.push_back({ parent, -1, -1, -1, -1 });
+    menu.separator.push_back(is_separator);
+    menu.subtree.push_back({ 0, 0 });
+    menu.item_y.push_back(0);
+    menu.layouts.push_back({ nullptr, 0, 0 });
+
+    if (parent < 0) return id;
+    int32_t last = menu.links[parent].last_child;
+    if (last >= 0)
+        menu.links[last].next_sibling = id;
+    else
+        menu.links[parent].first_child = id;
+    menu.links[parent].last_child = id;
+    return id;
+}
+
+// List an item's children as a new panel, one contiguous run of items
+static int add_panel(Menu& menu, int32_t owner) {
+    MenuPanel panel;
+    panel.owner = owner;
+    panel.first = menu.panel_items.size();
+    panel.count = 0;
+    for (int32_t c = menu.links[owner].first_child; c >= 0; c = menu.links[c].next_sibling) {
+        menu.panel_items.push_back(c);
+        panel.count++;
+    }
+    menu.links[owner].panel = menu.panels.size();
+    menu.panels.push_back(panel);
+    return menu.links[owner].panel;
+}
+
+static void mark_dirty(Menu& menu, int panel) {
+    menu.panels[panel].dirty = true;
+    menu.dirty = true;
+}
+
+// Add an item that was read after its panel was built. A panel's items
+// have to stay one contiguous run, so if other panels were built since,
+// the run is first moved to the end of panel_items. A filtered panel gets
+// it in the run kept aside, to be matched by the next query.
+static void append_to_panel(Menu& menu, int p, int32_t id) {
+    MenuPanel& panel = menu.panels[p];
+    bool filtered = p == menu.filter.panel;
+    uint32_t& first = filtered ? menu.filter.first : panel.first;
+    uint32_t& count = filtered ? menu.filter.count : panel.count;
+    if (first + count != menu.panel_items.size()) {
+        uint32_t moved = menu.panel_items.size();
+        menu.panel_items.resize(moved + count);
+        std::copy_n(menu.panel_items.begin() + first, count,
+                    menu.panel_items.begin() + moved);
+        first = moved;
+    }
+    menu.panel_items.push_back(id);
+    count++;
+    if (!filtered) mark_dirty(menu, p);
+}
+
+// Take all of the input at once. A regular file is mapped as is; anything
+// else (a pipe, a terminal) is drained in large blocks.
+static void load_input(Menu& menu, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            menu.input = static_cast<const char *>(data);
+            menu.input_size = st.st_size;
+            menu.mapping = data;
+            menu.mapping_size = st.st_size;
+            return;
+        }
+    }
+
+    size_t used = 0;
+    while (true) {
+        if (menu.input_storage.size() < used + input_block)
+            menu.input_storage.resize(used + input_block);
+        ssize_t n = read(fd, menu.input_storage.data() + used, input_block);
+        if (n < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) break;
+        used += n;
+    }
+    menu.input_storage.resize(used);
+    menu.input = menu.input_storage.data();
+    menu.input_size = used;
+}
+
+// One input line, split into indentation, label and output
+struct MenuLine {
+    int tabs;
+    const char *label;
+    const char *label_end;
+    const char *output;
+    const char *end;
+    const char *next;
+};
+
+// Lines are found with memchr and never copied: every label and output is
+// a view into the retained input, so line length is unlimited.
+static void split_line(const char *p, const char *end, MenuLine& line) {
+    const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+    line.end = nl ? nl : end;
+    line.next = nl ? nl + 1 : end;
+
+    line.tabs = 0;
+    while (p + line.tabs < line.end && p[line.tabs] == '\t') line.tabs++;
+    line.label = p + line.tabs;
+
+    // Split into label and output
+    line.label_end = line.end;
+    line.output = line.end;
+    const char *midtab = static_cast<const char *>(memchr(line.label, '\t', line.end - line.label));
+    if (midtab) {
+        line.label_end = midtab;
+        line.output = midtab + 1;
+    }
+}
+
+// Widen the submenu range of `id` to take in the line starting at `line`
+static void extend_subtree(Menu& menu, int32_t id, const char *line, const char *next) {
+    MenuRange& range = menu.subtree[id];
+    if (range.end == range.begin) {
+        range.begin = line - menu.input;
+        // The item just gained a submenu, and with it an arrow
+        int parent_panel = menu.links[menu.links[id].parent].panel;
+        if (parent_panel >= 0) mark_dirty(menu, parent_panel);
+    }
+    range.end = next - menu.input;
+}
+
+// File a line under `id`, whose children are indented by `child_tabs`.
+// Deeper lines only widen the range of a submenu that has not been built;
+// a built panel gets the item appended, so lines that arrive after their
+// submenu was opened still show up in it.
+static void place_line(Menu& menu, int32_t id, int child_tabs, const MenuLine& line,
+                       const char *line_start, bool is_separator) {
+    while (line.tabs > child_tabs) {
+        id = menu.links[id].last_child;
+        child_tabs++;
+        extend_subtree(menu, id, line_start, line.next);
+        if (menu.links[id].panel < 0) return;
+    }
+    int32_t child = append_item(menu, id, line.label, line.label_end - line.label,
+                                line.output, line.end - line.output, is_separator);
+    if (menu.links[id].panel >= 0)
+        append_to_panel(menu, menu.links[id].panel, child);
+}
+
+// Parse the complete lines read since the last call, or everything that is
+// left once the input has ended. Only top-level items are built; indented
+// lines are folded into the byte range of the item above them, to be built
+// if that submenu is ever opened. The structure of every line is still
+// checked here, so a bad line is reported as soon as it is read: parsing
+// stops and Menu::error says why.
+static void parse_lines(Menu& menu, bool at_end) {
+    if (menu.error) return;
+    if (menu.text.empty()) {
+        append_item(menu, -1, menu.input, 0, menu.input, 0, false);
+        menu.depth = 1;
+    }
+
+    const char *p = menu.input + menu.parsed;
+    const char *end = menu.input + menu.input_size;
+    if (!at_end) {
+        const char *nl = static_cast<const char *>(memrchr(p, '\n', end - p));
+        if (!nl) return;
+        end = nl + 1;
+    }
+
+    MenuLine line;
+    while (p < end) {
+        const char *line_start = p;
+        split_line(p, end, line);
+        p = line.next;
+
+        // Handle empty line: add a separator
+        if (line.label == line.end) {
+            menu.prev_was_empty = true;
+            menu.prev_tabs = 0;
+            line.tabs = 0;
+            place_line(menu, 0, 0, line, line_start, true);
+            continue;
+        }
+        if (line.tabs > 0 && menu.prev_was_empty) {
+            menu.error = "No separators in submenus";
+            return;
+        }
+        // Only the line right above can be the parent of an indented line
+        if (line.tabs > menu.prev_tabs + 1) {
+            menu.error = "Submenu item without a parent";
+            return;
+        }
+        menu.depth = std::max(menu.depth, (size_t)line.tabs + 1);
+        menu.prev_tabs = line.tabs;
+        menu.prev_was_empty = false;
+        place_line(menu, 0, 0, line, line_start, false);
+    }
+    menu.parsed = end - menu.input;
+
+    if (menu.links[0].first_child >= 0 && menu.links[0].panel < 0)
+        add_panel(menu, 0);
+}
+
+// A compiled menu starts with this header, followed by the arrays it
+// counts and then the menu text, each padded to 8 bytes. Images are a cache
+// for the build that wrote them, so everything is in native layout.
+struct MenuImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t scale; // in 120ths, as fractional scales are given
+    char font[64];
+    uint32_t items;
+    uint32_t panels;
+    uint32_t panel_items;
+    uint32_t depth;
+    uint64_t input_size;
+};
+
+struct MenuImagePanel {
+    int32_t owner;
+    uint32_t first;
+    uint32_t count;
+};
+
+struct MenuImageExtents {
+    int32_t width;
+    int32_t height;
+};
+
+static const char menu_image_magic[8] = { 'R', 'M', 'E', 'N', 'U', 'I', 'M', 'G' };
+static const uint32_t menu_image_version = 2;
+
+static void write_padded(FILE *out, const void *data, size_t size) {
+    static const char zeros[8] = {};
+    fwrite(data, 1, size, out);
+    fwrite(zeros, 1, (8 - size % 8) % 8, out);
+}
+
+// Write the whole tree with its label extents. Every submenu has to be
+// built and measured first, so loading never has to go back to the text.
+bool write_menu_image(const Menu& menu, const char *font, double scale, FILE *out) {
+    MenuImageHeader header = {};
+    memcpy(header.magic, menu_image_magic, sizeof(header.magic));
+    header.version = menu_image_version;
+    header.scale = lround(scale * 120);
+    strncpy(header.font, font, sizeof(header.font) - 1);
+    header.items = menu.text.size();
+    header.panels = menu.panels.size();
+    header.panel_items = menu.panel_items.size();
+    header.depth = menu.depth;
+    header.input_size = menu.input_size;
+
+    std::vector<MenuImageExtents> extents(menu.layouts.size());
+    for (size_t id = 0; id < menu.layouts.size(); ++id)
+        extents[id] = { menu.layouts[id].text_width, menu.layouts[id].text_height };
+    std::vector<MenuImagePanel> panels(menu.panels.size());
+    for (size_t p = 0; p < menu.panels.size(); ++p)
+        panels[p] = { menu.panels[p].owner, menu.panels[p].first, menu.panels[p].count };
+
+    write_padded(out, &header, sizeof(header));
+    write_padded(out, menu.text.data(), menu.text.size() * sizeof(MenuText));
+    write_padded(out, menu.links.data(), menu.links.size() * sizeof(MenuLinks));
+    write_padded(out, menu.subtree.data(), menu.subtree.size() * sizeof(MenuRange));
+    write_padded(out, menu.separator.data(), menu.separator.size());
+    write_padded(out, extents.data(), extents.size() * sizeof(MenuImageExtents));
+    write_padded(out, panels.data(), panels.size() * sizeof(MenuImagePanel));
+    write_padded(out, menu.panel_items.data(), menu.panel_items.size() * sizeof(int32_t));
+    write_padded(out, menu.input, menu.input_size);
+    fflush(out);
+    return !ferror(out);
+}
+
+// Everything an image holds is used as an index without further checks, so
+// a stale or damaged one must fail here rather than crash later. Items are
+// built after their parent and earlier siblings, which also rules out loops.
+// The depth sizes the per-level arrays, so it has to cover every item.
+static bool image_indexes_valid(const Menu& menu, uint64_t input_size, uint64_t depth) {
+    int32_t items = menu.text.size();
+    int32_t panels = menu.panels.size();
+    auto in_input = [input_size](uint64_t at, uint64_t len) {
+        return at <= input_size && len <= input_size - at;
+    };
+    auto after = [items](int32_t link, int32_t id) { return link == -1 || (link > id && link < items); };
+    for (int32_t id = 0; id < items; ++id) {
+        const MenuText& text = menu.text[id];
+        const MenuLinks& links = menu.links[id];
+        const MenuRange& range = menu.subtree[id];
+        if (!in_input(text.label, text.label_len) || !in_input(text.output, text.output_len) ||
+            range.begin > range.end || range.end > input_size)
+            return false;
+        if ((id == 0 ? links.parent != -1 : links.parent < 0 || links.parent >= id) ||
+            !after(links.first_child, id) || !after(links.last_child, id) || !after(links.next_sibling, id) ||
+            links.panel < -1 || links.panel >= panels)
+            return false;
+    }
+    // A panel and its owner name each other, and every panel but the top
+    // level opens from a panel of its own
+    for (int32_t p = 0; p < panels; ++p) {
+        const MenuPanel& panel = menu.panels[p];
+        if (panel.owner < 0 || panel.owner >= items || (p == 0) != (panel.owner == 0) ||
+            menu.links[panel.owner].panel != p || panel.first > menu.panel_items.size() ||
+            panel.count > menu.panel_items.size() - panel.first)
+            return false;
+        if (p && menu.links[menu.links[panel.owner].parent].panel < 0) return false;
+    }
+    std::vector<uint32_t> item_depth(items, 0);
+    for (int32_t id = 0; id < items; ++id) {
+        int32_t p = menu.links[id].panel;
+        if (p >= 0 && menu.panels[p].owner != id) return false;
+        if (id) item_depth[id] = item_depth[menu.links[id].parent] + 1;
+        if (item_depth[id] > depth) return false;
+    }
+    if (depth > (uint64_t)items) return false;
+    for (int32_t id : menu.panel_items) {
+        if (id <= 0 || id >= items) return false;
+    }
+    return true;
+}
+
+// Take the tree from a compiled image. The arrays are copied out in bulk
+// and the labels stay in the mapping, so nothing is parsed or built.
+// Returns false if the input is not an image at all.
+static bool load_image(Menu& menu) {
+    const char *data = menu.input;
+    size_t size = menu.input_size;
+    MenuImageHeader header;
+    if (size < sizeof(header) || memcmp(data, menu_image_magic, sizeof(menu_image_magic)) != 0)
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    size_t offset = sizeof(header);
+    bool fits = header.version == menu_image_version && !header.font[sizeof(header.font) - 1];
+    auto take = [&](size_t bytes) -> const char * {
+        if (!fits || bytes > size - offset) {
+            fits = false;
+            return nullptr;
+        }
+        const char *at = data + offset;
+        offset = std::min(size, offset + ((bytes + 7) & ~(size_t)7));
+        return at;
+    };
+    size_t items = header.items;
+    const char *text = take(items * sizeof(MenuText));
+    const char *links = take(items * sizeof(MenuLinks));
+    const char *subtree = take(items * sizeof(MenuRange));
+    const char *separator = take(items);
+    const char *extents = take(items * sizeof(MenuImageExtents));
+    const char *panels = take(header.panels * sizeof(MenuImagePanel));
+    const char *panel_items = take(header.panel_items * sizeof(int32_t));
+    const char *input = take(header.input_size);
+    // There is always a root item and a top level with something in it
+    if (!fits || !items || !header.panels || !header.panel_items) {
+        menu.error = "Corrupt menu image";
+        return true;
+    }
+
+    menu.text.resize(items);
+    menu.links.resize(items);
+    menu.subtree.resize(items);
+    menu.separator.resize(items);
+    menu.item_y.assign(items, 0);
+    menu.layouts.resize(items);
+    memcpy(menu.text.data(), text, items * sizeof(MenuText));
+    memcpy(menu.links.data(), links, items * sizeof(MenuLinks));
+    memcpy(menu.subtree.data(), subtree, items * sizeof(MenuRange));
+    memcpy(menu.separator.data(), separator, items);
+    for (size_t id = 0; id < items; ++id) {
+        MenuImageExtents e;
+        memcpy(&e, extents + id * sizeof(e), sizeof(e));
+        menu.layouts[id] = { nullptr, e.width, e.height };
+    }
+    menu.panels.resize(header.panels);
+    for (size_t p = 0; p < header.panels; ++p) {
+        MenuImagePanel ip;
+        memcpy(&ip, panels + p * sizeof(ip), sizeof(ip));
+        menu.panels[p].owner = ip.owner;
+        menu.panels[p].first = ip.first;
+        menu.panels[p].count = ip.count;
+    }
+    menu.panel_items.resize(header.panel_items);
+    memcpy(menu.panel_items.data(), panel_items, header.panel_items * sizeof(int32_t));
+    if (!image_indexes_valid(menu, header.input_size, header.depth)) {
+        menu.error = "Corrupt menu image";
+        return true;
+    }
+
+    menu.input = input;
+    menu.input_size = header.input_size;
+    menu.parsed = header.input_size;
+    menu.depth = header.depth;
+    menu.extents_font = data + offsetof(MenuImageHeader, font);
+    menu.extents_scale = header.scale / 120.0;
+    return true;
+}
+
+// Whether `fd` is a file holding a compiled image. Only the standalone path
+// maps its input, so images must not be handed to a daemon. Reads with
+// pread, leaving the file where it was for whoever parses it.
+bool is_menu_image(int fd) {
+    struct stat st;
+    char magic[sizeof(menu_image_magic)];
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+           pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+           memcmp(magic, menu_image_magic, sizeof(magic)) == 0;
+}
+
+void parse_menu(Menu& menu, int fd) {
+    load_input(menu, fd);
+    if (menu.mapping && load_image(menu)) return;
+    parse_lines(menu, true);
+}
+
+// Forget image extents that were compiled for another font or scale; the
+// labels are then measured as they come into view, like parsed ones
+void check_image_extents(Menu& menu, const char *font, double scale) {
+    if (!menu.extents_scale) return;
+    if (menu.extents_scale == scale && strcmp(menu.extents_font, font) == 0) return;
+    for (auto& ml : menu.layouts) {
+        if (!ml.layout) ml.text_width = ml.text_height = 0;
+    }
+    menu.extents_scale = 0;
+}
+
+// Read whatever the producer has written so far, without waiting for more,
+// and add its complete lines to the menu. Returns false at end of input or
+// once the input was rejected.
+bool read_menu(Menu& menu, int fd) {
+    if (menu.input_storage.size() < menu.input_size + input_block)
+        menu.input_storage.resize(menu.input_size + input_block);
+    ssize_t n = read(fd, menu.input_storage.data() + menu.input_size, input_block);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN) return true;
+        menu.error = strerror(errno);
+        return false;
+    }
+    // Items refer to the input by offset, so the storage is free to move
+    menu.input = menu.input_storage.data();
+    menu.input_size += n;
+    parse_lines(menu, n == 0);
+    return n > 0 && !menu.error;
+}
+
+static int item_depth(const Menu& menu, int32_t id) {
+    int depth = -1;
+    for (int32_t p = menu.links[id].parent; p >= 0; p = menu.links[p].parent)
+        depth++;
+    return depth;
+}
+
+// Build the children of `id` from its input range. Lines one level deeper
+// than `id` become items; anything deeper again is folded into the range of
+// the child above it, so grandchildren wait until they are opened in turn.
+static int build_submenu(Menu& menu, int32_t id) {
+    int child_tabs = item_depth(menu, id) + 1;
+    MenuRange range = menu.subtree[id];
+    const char *p = menu.input + range.begin;
+    const char *end = menu.input + range.end;
+    MenuLine line;
+    while (p < end) {
+        const char *line_start = p;
+        split_line(p, end, line);
+        p = line.next;
+        place_line(menu, id, child_tabs, line, line_start, false);
+    }
+    return add_panel(menu, id);
+}
+
+static const size_t label_cache_limit = 4096;
+
+// Give an item its layout, from the label cache when the menu has one
+static void shape_label(Menu& menu, int32_t id, PangoContext *pango,
+                        const PangoFontDescription *desc) {
+    MenuLayout& ml = menu.layouts[id];
+    LabelCache *cache = menu.label_cache;
+    std::string key;
+    if (cache) {
+        key.assign(menu.label(id), menu.text[id].label_len);
+        auto it = cache->layouts.find(key);
+        if (it != cache->layouts.end()) {
+            ml = it->second;
+            g_object_ref(ml.layout);
+            return;
+        }
+    }
+
+    ml.layout = pango_layout_new(pango);
+    pango_layout_set_font_description(ml.layout, desc);
+    pango_layout_set_text(ml.layout, menu.label(id), menu.text[id].label_len);
+    pango_layout_get_pixel_size(ml.layout, &ml.text_width, &ml.text_height);
+
+    if (cache) {
+        if (cache->layouts.size() >= label_cache_limit) clear_label_cache(*cache);
+        g_object_ref(ml.layout);
+        cache->layouts.emplace(std::move(key), ml);
+    }
+}
+
+// Geometry assignment for one panel. A submenu is placed right of its
+// parent panel, aligned with the item that opened it as it is shown, so the
+// parent has to be measured first. A panel taller than max_height is cut
+// to it and scrolls; a submenu that would run off the bottom moves up.
+//
+// Only rows inside the panel's window are shaped, so the cost does not
+// grow with the length of the list. The panel is as wide as the widest
+// label measured so far. Existing layouts are only re-shaped with `reshape`,
+// when their context has changed.
+static void measure_panel(Menu& menu, MenuPanel& panel, PangoContext *pango,
+                          const PangoFontDescription *desc, bool reshape) {
+    int base_x = 0, base_y = 0;
+    if (panel.owner != 0) {
+        const MenuPanel& parent = menu.panels[menu.links[menu.links[panel.owner].parent].panel];
+        base_x = parent.bounds.x + parent.bounds.w; // right of this menu
+        base_y = menu.item_y[panel.owner] - parent.scroll; // aligned with item
+    }
+
+    int content_height = -button_spacing;
+    for (size_t pos = 0; pos < panel.count; ++pos)
+        content_height += row_height(menu, menu.item(panel, pos));
+    if (!panel.count) content_height = button_height; // filtered down to nothing
+    int height = content_height;
+    if (menu.max_height > 0 && height > menu.max_height) height = menu.max_height;
+    if (menu.max_height > 0 && base_y + height > menu.max_height)
+        base_y = std::max(0, menu.max_height - height);
+    panel.content_height = content_height;
+    panel.scroll = std::max(0, std::min(panel.scroll, content_height - height));
+
+    // Compute the y position for each item, accounting for separators
+    int y = base_y;
+    for (size_t pos = 0; pos < panel.count; ++pos) {
+        int32_t id = menu.item(panel, pos);
+        menu.item_y[id] = y;
+        y += row_height(menu, id);
+    }
+    panel.bounds.x = base_x;
+    panel.bounds.y = base_y;
+    panel.bounds.h = height;
+
+    size_t begin, end;
+    visible_items(menu, panel, begin, end);
+    int max_text_width = 0;
+    for (size_t pos = 0; pos < panel.count; ++pos) {
+        int32_t id = menu.item(panel, pos);
+        if (menu.separator[id]) continue;
+        MenuLayout& ml = menu.layouts[id];
+        if (!ml.layout) {
+            if (pos >= begin && pos < end)
+                shape_label(menu, id, pango, desc);
+            else if (!ml.text_height)
+                continue; // not measured yet
+        } else if (reshape) {
+            pango_layout_context_changed(ml.layout);
+            pango_layout_get_pixel_size(ml.layout, &ml.text_width, &ml.text_height);
+        }
+
+        int total_width = ml.text_width + 2 * text_padding;
+        if (menu.has_submenu(id)) total_width += 20; // space for arrow
+        if (total_width > max_text_width) max_text_width = total_width;
+    }
+
+    int logical_width = max_text_width;
+    if (logical_width < min_width) logical_width = min_width;
+    panel.bounds.w = logical_width;
+}
+
+// Measure a flagged panel, after the panels above it. Its raster no longer
+// matches and is dropped, to be drawn again, and the built submenus listed
+// in it are flagged in turn, as they sit against its right edge.
+static void remeasure_panel(Menu& menu, MenuPanel& panel, PangoContext *pango,
+                            const PangoFontDescription *desc) {
+    measure_panel(menu, panel, pango, desc, panel.reshape);
+    if (panel.raster) cairo_surface_destroy(panel.raster);
+    panel.raster = nullptr;
+    panel.dirty = panel.reshape = false;
+    for (size_t pos = 0; pos < panel.count; ++pos) {
+        int sub = menu.links[menu.item(panel, pos)].panel;
+        if (sub >= 0) menu.panels[sub].dirty = true;
+    }
+}
+
+// Re-measure the root panel for a changed context. The other panels built
+// so far are only flagged, to be measured by open_submenu as they are
+// opened: a compiled image has every submenu built, and measuring them all
+// would shape far more labels than the first frame shows.
+void measure_menu(Menu& menu, PangoContext *pango, const PangoFontDescription *desc) {
+    for (auto& panel : menu.panels)
+        panel.dirty = panel.reshape = true;
+    if (!menu.empty()) remeasure_panel(menu, menu.panels[0], pango, desc);
+    menu.dirty = false;
+}
+
+// Re-measure the root panel if it was read into, scrolled or filtered.
+// Other panels that were, and those below them, are measured by
+// open_submenu when they are next opened, so a change costs only the
+// panels that are shown again rather than every panel built so far.
+//
+// While the whole tree is filtered, panel 0 lists items of other panels,
+// which are all hidden. None of them has a submenu, so nothing is flagged
+// below it until the filter is cleared.
+void measure_dirty_panels(Menu& menu, PangoContext *pango, const PangoFontDescription *desc) {
+    if (!menu.dirty) return;
+    if (menu.panels[0].dirty) remeasure_panel(menu, menu.panels[0], pango, desc);
+    menu.dirty = false;
+}
+
+void set_menu_max_height(Menu& menu, int height) {
+    if (menu.max_height == height) return;
+    menu.max_height = height;
+    for (size_t p = 0; p < menu.panels.size(); ++p)
+        mark_dirty(menu, p);
+}
+
+// Move a panel's content by `dy`, staying within it. Returns false when the
+// panel cannot scroll that way.
+bool scroll_panel(Menu& menu, int p, int dy) {
+    MenuPanel& panel = menu.panels[p];
+    int scroll = panel.scroll + dy;
+    scroll = std::max(0, std::min(scroll, panel.content_height - panel.bounds.h));
+    if (scroll == panel.scroll) return false;
+    panel.scroll = scroll;
+    mark_dirty(menu, p);
+    return true;
+}
+
+// The panel for the submenu of `id`, building and measuring it the first
+// time it is opened, and measuring it again if it was flagged since. The
+// panels above it must be measured already.
+int open_submenu(Menu& menu, int32_t id, PangoContext *pango, const PangoFontDescription *desc) {
+    if (menu.links[id].panel < 0) {
+        int panel = build_submenu(menu, id);
+        measure_panel(menu, menu.panels[panel], pango, desc, false);
+    } else if (menu.panels[menu.links[id].panel].dirty) {
+        remeasure_panel(menu, menu.panels[menu.links[id].panel], pango, desc);
+    }
+    return menu.links[id].panel;
+}
+
+// Scroll a panel just far enough to show the item at `pos` in full
+bool reveal_item(Menu& menu, int p, size_t pos) {
+    const MenuPanel& panel = menu.panels[p];
+    Rect box = menu.item_box(panel, pos);
+    int dy = 0;
+    if (box.y < panel.bounds.y)
+        dy = box.y - panel.bounds.y;
+    else if (box.y + box.h > panel.bounds.y + panel.bounds.h)
+        dy = box.y + box.h - (panel.bounds.y + panel.bounds.h);
+    return dy && scroll_panel(menu, p, dy);
+}
+
+// Whether a label contains the query, ignoring ASCII case. The query is
+// already folded. Candidates for its first byte are found with memchr,
+// which scans whole vectors at a time, and only those are compared in full.
+static bool label_contains(const char *label, size_t len, const char *query, size_t query_len) {
+    if (query_len > len) return false;
+    const char *last = label + len - query_len; // last place a match can start
+    unsigned char lower = query[0];
+    unsigned char upper = toupper(lower);
+    for (const char *p = label; p <= last;) {
+        size_t room = last - p + 1;
+        const char *hit = static_cast<const char *>(memchr(p, lower, room));
+        if (upper != lower) {
+            const char *alt = static_cast<const char *>(memchr(p, upper, hit ? hit - p : room));
+            if (alt) hit = alt;
+        }
+        if (!hit) return false;
+        if (strncasecmp(hit + 1, query + 1, query_len - 1) == 0) return true;
+        p = hit + 1;
+    }
+    return false;
+}
+
+// The item for the line whose label starts at `label`, somewhere in the
+// submenu of `id`. Only the submenus on the way down to it are built. Lines
+// are looked up in input order, so the walk carries on from `after`, the
+// item found for the line before, rather than from the first child again.
+static int32_t item_for_line(Menu& menu, int32_t id, uint32_t label, int32_t after) {
+    int32_t parent = after >= 0 ? menu.links[after].parent : id;
+    int32_t c = after;
+    if (c < 0) {
+        if (menu.links[id].panel < 0) build_submenu(menu, id);
+        c = menu.links[id].first_child;
+    }
+    while (true) {
+        while (c >= 0 && menu.text[c].label != label &&
+               !(label >= menu.subtree[c].begin && label < menu.subtree[c].end))
+            c = menu.links[c].next_sibling;
+        if (c >= 0 && menu.text[c].label == label) return c;
+        if (c >= 0) {
+            if (menu.links[c].panel < 0) build_submenu(menu, c);
+            parent = c;
+            c = menu.links[c].first_child;
+            continue;
+        }
+        // Past the last child: the line comes after this submenu
+        if (parent == id) return -1;
+        c = menu.links[parent].next_sibling;
+        parent = menu.links[parent].parent;
+    }
+}
+
+// Add the leaf items below `id` whose label contains the query to the
+// matches, in input order. Built panels are followed by their links; a
+// submenu that was never opened is searched in its input range, line by
+// line, and only built if something in it matches.
+static void match_tree(Menu& menu, int32_t id, const char *query, size_t query_len) {
+    for (int32_t c = menu.links[id].first_child; c >= 0; c = menu.links[c].next_sibling) {
+        if (menu.separator[c]) continue;
+        if (menu.links[c].panel >= 0) {
+            match_tree(menu, c, query, query_len);
+        } else if (menu.has_submenu(c)) {
+            MenuRange range = menu.subtree[c];
+            const char *p = menu.input + range.begin;
+            const char *end = menu.input + range.end;
+            MenuLine line, next;
+            int32_t found = -1;
+            split_line(p, end, line);
+            while (true) {
+                bool last = line.next >= end;
+                if (!last) split_line(line.next, end, next);
+                // A line followed by a deeper one has a submenu of its own
+                bool leaf = last || next.tabs <= line.tabs;
+                if (leaf && label_contains(line.label, line.label_end - line.label, query, query_len)) {
+                    int32_t item = item_for_line(menu, c, line.label - menu.input, found);
+                    if (item >= 0) menu.filter.matches.push_back(found = item);
+                }
+                if (last) break;
+                line = next;
+            }
+        } else {
+            const MenuText& text = menu.text[c];
+            if (label_contains(menu.input + text.label, text.label_len, query, query_len))
+                menu.filter.matches.push_back(c);
+        }
+    }
+}
+
+// Narrow a panel, or with `tree` the whole menu, down to the items whose
+// label contains `query`. Typing only ever adds to the query, so when it
+// extends the last one just the last matches are searched again; anything
+// else starts over from all of the items.
+void filter_menu(Menu& menu, int p, bool tree, const char *query, size_t len) {
+    if (!len) {
+        clear_menu_filter(menu);
+        return;
+    }
+    if (tree) p = 0;
+    MenuFilter& filter = menu.filter;
+    if (filter.panel != p || filter.tree != tree) {
+        clear_menu_filter(menu);
+        MenuPanel& panel = menu.panels[p];
+        filter.panel = p;
+        filter.tree = tree;
+        filter.first = panel.first;
+        filter.count = panel.count;
+        // The matches go in a run of their own after everything else
+        panel.first = menu.panel_items.size();
+        panel.count = 0;
+    }
+
+    std::string folded(query, len);
+    for (char& c : folded) c = tolower((unsigned char)c);
+    bool narrowing = !filter.query.empty() && folded.compare(0, filter.query.size(), filter.query) == 0;
+    const int32_t *from = menu.panel_items.data() + filter.first;
+    size_t count = filter.count;
+    if (narrowing) {
+        from = menu.panel_items.data() + menu.panels[p].first;
+        count = menu.panels[p].count;
+    }
+
+    filter.matches.clear();
+    if (tree && !narrowing) {
+        match_tree(menu, 0, folded.data(), folded.size());
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            const MenuText& text = menu.text[from[i]];
+            if (label_contains(menu.input + text.label, text.label_len, folded.data(), folded.size()))
+                filter.matches.push_back(from[i]);
+        }
+    }
+    filter.query = std::move(folded);
+
+    // Matching may have built submenus, which moves the panels
+    MenuPanel& panel = menu.panels[p];
+    if (panel.first + panel.count == menu.panel_items.size())
+        menu.panel_items.resize(panel.first);
+    panel.first = menu.panel_items.size();
+    panel.count = filter.matches.size();
+    menu.panel_items.insert(menu.panel_items.end(), filter.matches.begin(), filter.matches.end());
+    panel.scroll = 0;
+    mark_dirty(menu, p);
+}
+
+// Give the filtered panel its own items back
+void clear_menu_filter(Menu& menu) {
+    MenuFilter& filter = menu.filter;
+    if (filter.panel < 0) return;
+    MenuPanel& panel = menu.panels[filter.panel];
+    if (panel.first + panel.count == menu.panel_items.size())
+        menu.panel_items.resize(panel.first);
+    panel.first = filter.first;
+    panel.count = filter.count;
+    panel.scroll = 0;
+    mark_dirty(menu, filter.panel);
+    filter.panel = -1;
+    filter.tree = false;
+    filter.query.clear();
+}
+
+void free_menu(Menu& menu) {
+    for (auto& panel : menu.panels) {
+        if (panel.raster) cairo_surface_destroy(panel.raster);
+        panel.raster = nullptr;
+    }
+    for (auto& ml : menu.layouts) {
+        if (ml.layout) g_object_unref(ml.layout);
+        ml.layout = nullptr;
+    }
+    if (menu.mapping) munmap(menu.mapping, menu.mapping_size);
+    menu.mapping = nullptr;
+    menu.mapping_size = 0;
+    menu.input = nullptr;
+    menu.input_size = 0;
+    menu.input_storage.clear();
+}
+
+template <typename T>
+static size_t vector_bytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+void menu_stats(const Menu& menu, MenuStats& stats) {
+    stats = MenuStats();
+    stats.input_heap = vector_bytes(menu.input_storage);
+    stats.input_mapped = menu.mapping_size;
+    stats.item_bytes = vector_bytes(menu.text) + vector_bytes(menu.links) + vector_bytes(menu.separator) +
+                       vector_bytes(menu.subtree) + vector_bytes(menu.item_y) + vector_bytes(menu.layouts);
+    stats.panel_bytes = vector_bytes(menu.panels) + vector_bytes(menu.panel_items);
+    stats.filter_bytes = menu.filter.query.capacity() + vector_bytes(menu.filter.matches);
+
+    for (size_t id = 1; id < menu.text.size(); ++id) {
+        size_t depth = item_depth(menu, id);
+        if (depth >= stats.items_per_depth.size()) stats.items_per_depth.resize(depth + 1);
+        stats.items_per_depth[depth]++;
+        if (menu.layouts[id].layout) stats.layouts++;
+        if (menu.links[id].panel < 0 && menu.has_submenu(id)) stats.unbuilt_submenus++;
+    }
+    for (size_t p = 0; p < menu.panels.size(); ++p) {
+        const MenuPanel& panel = menu.panels[p];
+        if (panel.raster) {
+            stats.rasters++;
+            stats.raster_bytes += (size_t)cairo_image_surface_get_stride(panel.raster) *
+                                  cairo_image_surface_get_height(panel.raster);
+        }
+        if (stats.largest_panel < 0 || panel.count > menu.panels[stats.largest_panel].count)
+            stats.largest_panel = p;
+    }
+}
+
+void clear_label_cache(LabelCache& cache) {
+    for (auto& entry : cache.layouts)
+        g_object_unref(entry.second.layout);
+    cache.layouts.clear();
+}
+
+void print_item(const Menu& menu, int32_t id, FILE *out) {
+    const MenuText& text = menu.text[id];
+    if (text.output_len) {
+        fwrite(menu.input + text.output, 1, text.output_len, out);
+    } else {
+        fwrite(menu.input + text.label, 1, text.label_len, out);
+    }
+    fputc('\n', out);
+    fflush(out);
+}
+
+// Items are laid out top to bottom, so a panel's run of items is already
+// sorted by y and the item under the pointer is found with a binary search.
+// The pointer is on screen, item positions are within the scrolled content.
+int item_at(const Menu& menu, const MenuPanel& panel, int px, int py) {
+    const int32_t *run = menu.panel_items.data() + panel.first;
+    const int32_t *it = std::upper_bound(run, run + panel.count, py + panel.scroll,
+        [&menu](int y, int32_t id) { return y < menu.item_y[id]; });
+    if (it == run) return -1;
+    --it;
+    int pos = it - run;
+    Rect box = menu.item_box(panel, pos);
+    if (menu.separator[*it] || px < box.x || px > box.x + box.w || py > box.y + box.h)
+        return -1;
+    return pos;
+}
+
+// Button borders are stroked on the item edge, so they bleed one pixel out
+Rect item_rect(const Menu& menu, const MenuPanel& panel, size_t pos) {
+    Rect box = menu.item_box(panel, pos);
+    return { box.x - 1, box.y - 1, box.w + 2, box.h + 2 };
+}
+
+// Rasters reach past the panel by whole pixels, at least one logical pixel
+// for border bleed, so they line up with buffers at any scale
+int raster_margin(double scale) {
+    return ceil(scale);
+}
+
+static bool needs_repaint(const Rect *only, size_t count, const Rect& r) {
+    if (!only) return true;
+    for (size_t i = 0; i < count; ++i) {
+        if (r.intersects(only[i])) return true;
+    }
+    return false;
+}
+
+// Point a pango context at an output scale, the way a cairo context
+// scaled to it would
+void scale_pango_context(PangoContext *pango, double scale) {
+    cairo_surface_t *temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *temp_cr = cairo_create(temp_surface);
+    cairo_scale(temp_cr, scale, scale);
+    pango_cairo_update_context(temp_cr, pango);
+    cairo_destroy(temp_cr);
+    cairo_surface_destroy(temp_surface);
+}
+
+// Draw a panel, or with `only` set just the items touching those rects.
+// Labels are drawn from their shaped layouts, or, with `scratch`, set into
+// that layout first: a thread other than the one the menu's layouts belong
+// to draws with a layout of its own context.
+void render_menu_panel(
+    cairo_t* cr,
+    const Menu& menu,
+    const MenuPanel& panel,
+    int hovered,
+    const Rect *only,
+    size_t count,
+    PangoLayout *scratch
+) {
+    // Draw menu background
+    cairo_set_source_rgb(cr, menu_back[0], menu_back[1], menu_back[1]);
+    cairo_rectangle(cr, panel.bounds.x, panel.bounds.y, panel.bounds.w, panel.bounds.h);
+    cairo_fill(cr);
+
+    // Draw the menu items in view
+    size_t begin, end;
+    visible_items(menu, panel, begin, end);
+    for (size_t i = begin; i < end; ++i) {
+        if (!needs_repaint(only, count, item_rect(menu, panel, i))) continue;
+        int32_t id = menu.item(panel, i);
+        Rect item = menu.item_box(panel, i);
+
+        if (menu.separator[id]) {
+            //Draw horizontal line in the center of the separator box
+            double sep_y = item.y;
+            cairo_set_source_rgb(cr, sep_color[0], sep_color[1], sep_color[2]);
+            cairo_set_line_width(cr, separator_size);
+            cairo_move_to(cr, item.x + 5, sep_y + separator_size/2.0);
+            cairo_line_to(cr, item.x + item.w - 5, sep_y + separator_size/2.0);
+            cairo_stroke(cr);
+            continue;
+        }
+
+        // Highlight hovered item at this level
+        bool is_hovered = hovered == (int)i;
+
+        // Button background color
+        if (is_hovered)
+            cairo_set_source_rgb(cr, hovered_color[0], hovered_color[1], hovered_color[2]);
+        else
+            cairo_set_source_rgb(cr, button_color[0], button_color[1], button_color[2]);
+
+        cairo_rectangle(cr, item.x, item.y, item.w, item.h);
+        cairo_fill(cr);
+
+        // Draw button border
+        cairo_set_source_rgb(cr, border_color[0], border_color[1], border_color[2]);
+        cairo_set_line_width(cr, 1.0);
+        cairo_rectangle(cr, item.x, item.y, item.w, item.h);
+        cairo_stroke(cr);
+
+        // Draw text
+        const MenuLayout& ml = menu.layouts[id];
+        int text_height = ml.text_height;
+        cairo_set_source_rgb(cr, text_color[0], text_color[1], text_color[2]);
+        cairo_move_to(cr, item.x + text_padding, item.y + (item.h - text_height) / 2);
+        if (scratch) {
+            pango_layout_set_text(scratch, menu.label(id), menu.text[id].label_len);
+            pango_cairo_show_layout(cr, scratch);
+        } else {
+            pango_cairo_show_layout(cr, ml.layout);
+        }
+
+        // Draw arrow for submenu
+        if (menu.has_submenu(id)) {
+            double arrow_size = text_height * 0.5;
+            double arrow_margin = 4.0; // distance from right edge
+            double arrow_x = item.x + item.w - arrow_size - arrow_margin;
+            double arrow_y = item.y + (item.h - arrow_size) / 2;
+            cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+            cairo_move_to(cr, arrow_x, arrow_y);
+            cairo_line_to(cr, arrow_x + arrow_size, arrow_y + arrow_size / 2);
+            cairo_line_to(cr, arrow_x, arrow_y + arrow_size);
+            cairo_close_path(cr);
+            cairo_fill(cr);
+        }
+    }
+}
+
+// Raster rows drawn at a time by draw_panel_raster
+static const int raster_band_rows = 256;
+
+// Draw a panel from scratch, with nothing lit, into a raster of its own
+// rather than the panel's. This is for a thread other than the menu's, with
+// `scratch` from that thread's context. Rows are drawn a band at a time, and
+// once `stop` is set the raster is given up between bands, returning null.
+cairo_surface_t *draw_panel_raster(const Menu& menu, const MenuPanel& panel, double scale,
+                                   PangoLayout *scratch, const std::atomic<bool>& stop) {
+    const Rect& b = panel.bounds;
+    int margin = raster_margin(scale);
+    int width = lround(b.w * scale) + 2 * margin;
+    int height = lround(b.h * scale) + 2 * margin;
+    cairo_surface_t *raster = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_surface_set_device_scale(raster, scale, scale);
+    cairo_t *cr = cairo_create(raster);
+
+    int y = 0;
+    for (; y < height && !stop.load(std::memory_order_relaxed); y += raster_band_rows) {
+        int rows = std::min(raster_band_rows, height - y);
+        // Bands are clipped on whole pixels, so nothing is blended twice
+        // where they meet
+        cairo_save(cr);
+        cairo_rectangle(cr, 0, y / scale, width / scale, rows / scale);
+        cairo_clip(cr);
+        cairo_translate(cr, margin / scale - b.x, margin / scale - b.y);
+        double top = b.y + (y - margin) / scale;
+        Rect band = { b.x - margin, (int)floor(top), b.w + 2 * margin, (int)ceil(rows / scale) + 1 };
+        render_menu_panel(cr, menu, panel, -1, &band, 1, scratch);
+        cairo_restore(cr);
+    }
+    cairo_destroy(cr);
+    if (y < height) {
+        cairo_surface_destroy(raster);
+        return nullptr;
+    }
+    cairo_surface_flush(raster);
+    return raster;
+}
+
+// Bring a panel's cached raster up to date. Unless the scale changed, the
+// only thing that can differ is which item is lit, so just those two
+// buttons are drawn again. Returns the bytes of raster drawn.
+size_t update_panel_raster(Menu& menu, MenuPanel& panel, int hovered, double scale,
+                           PangoLayout *scratch) {
+    bool fresh = !panel.raster || panel.raster_scale != scale;
+    if (!fresh && panel.raster_hovered == hovered) return 0;
+
+    const Rect& b = panel.bounds;
+    int margin = raster_margin(scale);
+    if (fresh) {
+        if (panel.raster) cairo_surface_destroy(panel.raster);
+        panel.raster = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            lround(b.w * scale) + 2 * margin, lround(b.h * scale) + 2 * margin);
+        cairo_surface_set_device_scale(panel.raster, scale, scale);
+        panel.raster_scale = scale;
+    }
+
+    cairo_t *cr = cairo_create(panel.raster);
+    cairo_translate(cr, margin / scale - b.x, margin / scale - b.y);
+
+    Rect changed[2];
+    size_t count = 0;
+    size_t drawn = (size_t)cairo_image_surface_get_stride(panel.raster) *
+                   cairo_image_surface_get_height(panel.raster);
+    if (!fresh) {
+        for (int idx : { panel.raster_hovered, hovered }) {
+            if (idx >= 0 && idx < (int)panel.count)
+                changed[count++] = item_rect(menu, panel, idx);
+        }
+        drawn = 0;
+        for (size_t i = 0; i < count; ++i) {
+            cairo_rectangle(cr, changed[i].x, changed[i].y, changed[i].w, changed[i].h);
+            drawn += (size_t)lround(changed[i].w * scale) * lround(changed[i].h * scale) * 4;
+        }
+        cairo_clip(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(cr);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    }
+
+    render_menu_panel(cr, menu, panel, hovered, fresh ? nullptr : changed, count, scratch);
+    cairo_destroy(cr);
+    cairo_surface_flush(panel.raster);
+    panel.raster_hovered = hovered;
+    return drawn;
+}
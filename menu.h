@@ -0,0 +1,184 @@
+#pragma once
+
+extern "C" {
+#include <cairo/cairo.h>
+#include <pango/pangocairo.h>
+#include <stdint.h>
+#include <stdio.h>
+}
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Rect {
+    int x = 0, y = 0, w = 0, h = 0;
+    bool intersects(const Rect& o) const {
+        return x < o.x + o.w && o.x < x + w && y < o.y + o.h && o.y < y + h;
+    }
+};
+
+// Label and output of an item, as views into the menu input
+struct MenuText {
+    uint32_t label;
+    uint32_t label_len;
+    uint32_t output;
+    uint32_t output_len;
+};
+
+// Tree links between items. `panel` is the panel listing this item's
+// children, or -1 while that submenu has not been built (or there is none).
+struct MenuLinks {
+    int32_t parent;
+    int32_t first_child;
+    int32_t last_child;
+    int32_t next_sibling;
+    int32_t panel;
+};
+
+// Input lines making up an item's submenu, not yet turned into items
+struct MenuRange {
+    uint32_t begin;
+    uint32_t end;
+};
+
+// Shaped label of one item, reused until the pango context changes
+struct MenuLayout {
+    PangoLayout *layout;
+    int text_width;
+    int text_height;
+};
+
+// Shaped labels kept by a long-running process for the menus it shows
+// after, by label text. Entries hold their own reference to the layout and
+// are only good for the scale they were shaped at.
+struct LabelCache {
+    std::unordered_map<std::string, MenuLayout> layouts;
+    double scale = 0;
+};
+
+// The children of one item, shown together as one menu panel. They are
+// listed top to bottom as a contiguous run of Menu::panel_items. `bounds`
+// is the part on screen; a panel taller than that scrolls its content.
+struct MenuPanel {
+    int32_t owner;
+    uint32_t first;
+    uint32_t count;
+    Rect bounds;
+    int content_height = 0;
+    int scroll = 0;
+    // Rasterized panel, valid for raster_scale with raster_hovered lit. It
+    // has a margin of raster_margin() pixels around the panel's bounds.
+    cairo_surface_t *raster = nullptr;
+    int raster_hovered = -1;
+    double raster_scale = 0;
+    bool dirty = false; // has to be measured again
+    bool reshape = false; // and its layouts predate a change of context
+};
+
+// A typed query narrowing one panel down to the items that match it. The
+// panel lists the matches in place of its own run of items, which is kept
+// aside in `first` and `count` until the filter is cleared. A filter over
+// the whole tree lists the matching leaf items from anywhere in panel 0.
+struct MenuFilter {
+    int panel = -1;
+    bool tree = false;
+    uint32_t first = 0;
+    uint32_t count = 0;
+    std::string query; // folded to lower case
+    std::vector<int32_t> matches;
+};
+
+// The whole menu tree, flattened into parallel arrays indexed by item in the
+// order the items were built. Item 0 is an invisible root whose children make
+// up the top-level menu, which is always panel 0. Only the top level is built
+// up front; a submenu stays a byte range of the input until it is opened.
+struct Menu {
+    // The input text, kept for the life of the menu. It is either mapped
+    // straight from the file on stdin, possibly as part of a compiled
+    // image, or read into input_storage.
+    const char *input = nullptr;
+    size_t input_size = 0;
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    std::vector<char> input_storage;
+    // Label extents loaded from a compiled image are only good for the font
+    // and scale it was compiled for
+    const char *extents_font = nullptr;
+    double extents_scale = 0;
+    // How far the input has been parsed, for input that is still arriving
+    size_t parsed = 0;
+    int prev_tabs = -1;
+    bool prev_was_empty = false;
+    bool dirty = false;
+    int max_height = 0; // tallest a panel may be, 0 for no limit
+    const char *error = nullptr; // why the input was rejected
+    LabelCache *label_cache = nullptr;
+    MenuFilter filter;
+
+    std::vector<MenuText> text;
+    std::vector<MenuLinks> links;
+    std::vector<uint8_t> separator;
+    std::vector<MenuRange> subtree;
+    std::vector<int32_t> item_y; // the only per-item data hit-testing reads
+    std::vector<MenuLayout> layouts;
+    std::vector<MenuPanel> panels;
+    std::vector<int32_t> panel_items;
+    size_t depth = 0;
+
+    bool empty() const { return panels.empty(); }
+    int32_t item(const MenuPanel& panel, size_t pos) const { return panel_items[panel.first + pos]; }
+    const char *label(int32_t id) const { return input + text[id].label; }
+    bool has_submenu(int32_t id) const {
+        return links[id].panel >= 0 || subtree[id].end > subtree[id].begin;
+    }
+    Rect item_box(const MenuPanel& panel, size_t pos) const;
+};
+
+// Where a menu's memory goes, for --stats. Vectors count their capacity.
+// Items are only those built so far; submenus that were never opened are
+// still byte ranges of the input.
+struct MenuStats {
+    size_t input_heap = 0;   // input read into memory
+    size_t input_mapped = 0; // input mapped from the file
+    size_t item_bytes = 0;   // the per-item arrays
+    size_t panel_bytes = 0;  // panels and their runs of items
+    size_t filter_bytes = 0;
+    size_t layouts = 0;      // shaped labels held
+    size_t rasters = 0;
+    size_t raster_bytes = 0;
+    size_t unbuilt_submenus = 0;
+    std::vector<size_t> items_per_depth;
+    int largest_panel = -1;  // by item count
+};
+
+void parse_menu(Menu& menu, int fd);
+bool is_menu_image(int fd);
+bool write_menu_image(const Menu& menu, const char *font, double scale, FILE *out);
+void check_image_extents(Menu& menu, const char *font, double scale);
+bool read_menu(Menu& menu, int fd);
+void measure_menu(Menu& menu, PangoContext *pango, const PangoFontDescription *desc);
+void measure_dirty_panels(Menu& menu, PangoContext *pango, const PangoFontDescription *desc);
+void set_menu_max_height(Menu& menu, int height);
+bool scroll_panel(Menu& menu, int panel, int dy);
+int open_submenu(Menu& menu, int32_t id, PangoContext *pango, const PangoFontDescription *desc);
+bool reveal_item(Menu& menu, int panel, size_t pos);
+void filter_menu(Menu& menu, int panel, bool tree, const char *query, size_t len);
+void clear_menu_filter(Menu& menu);
+void free_menu(Menu& menu);
+void clear_label_cache(LabelCache& cache);
+void print_item(const Menu& menu, int32_t id, FILE *out);
+void menu_stats(const Menu& menu, MenuStats& stats);
+
+int item_at(const Menu& menu, const MenuPanel& panel, int px, int py);
+Rect item_rect(const Menu& menu, const MenuPanel& panel, size_t pos);
+int raster_margin(double scale);
+
+void scale_pango_context(PangoContext *pango, double scale);
+void render_menu_panel(cairo_t *cr, const Menu& menu, const MenuPanel& panel, int hovered,
+                       const Rect *only = nullptr, size_t count = 0, PangoLayout *scratch = nullptr);
+cairo_surface_t *draw_panel_raster(const Menu& menu, const MenuPanel& panel, double scale,
+                                   PangoLayout *scratch, const std::atomic<bool>& stop);
+size_t update_panel_raster(Menu& menu, MenuPanel& panel, int hovered, double scale,
+                         PangoLayout *scratch = nullptr);
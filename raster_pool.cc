@@ -0,0 +1,225 @@
+extern "C" {
+#include <pango/pangocairo.h>
+#include <glib-object.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include "raster_pool.h"
+#include "trace.h"
+
+// A worker's own text setup, made on the worker's thread on its first job
+struct WorkerText {
+    PangoFontMap *font_map = nullptr;
+    PangoContext *pango = nullptr;
+    PangoLayout *layout = nullptr;
+    double scale = 0;
+    const PangoFontDescription *desc = nullptr;
+
+    void prepare(double to_scale, const PangoFontDescription *to_desc) {
+        if (!pango) {
+            font_map = pango_cairo_font_map_new();
+            pango = pango_font_map_create_context(font_map);
+            layout = pango_layout_new(pango);
+        }
+        if (scale != to_scale) {
+            scale_pango_context(pango, to_scale);
+            pango_layout_context_changed(layout);
+            scale = to_scale;
+        }
+        if (desc != to_desc) {
+            pango_layout_set_font_description(layout, to_desc);
+            desc = to_desc;
+        }
+    }
+    ~WorkerText() {
+        if (layout) g_object_unref(layout);
+        if (pango) g_object_unref(pango);
+        if (font_map) g_object_unref(font_map);
+    }
+};
+
+RasterPool::RasterPool(size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        threads.emplace_back(&RasterPool::work, this);
+}
+
+RasterPool::~RasterPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+size_t RasterPool::default_threads() {
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 1 ? std::min(cores - 1, 3u) : 0;
+}
+
+void RasterPool::work() {
+    WorkerText text;
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || batch != seen; });
+        if (stopping) break;
+        seen = batch;
+        while (next_job < jobs.size()) {
+            RasterJob job = jobs[next_job++];
+            lock.unlock();
+            size_t bytes;
+            {
+                TraceScope span("render");
+                text.prepare(scale, desc);
+                bytes = update_panel_raster(*menu, menu->panels[job.panel], job.hovered, scale, text.layout);
+            }
+            lock.lock();
+            drawn += bytes;
+            if (++finished == jobs.size()) done.notify_one();
+        }
+    }
+}
+
+size_t RasterPool::update(Menu& to_menu, const std::vector<RasterJob>& to_jobs, double to_scale,
+                          const PangoFontDescription *to_desc) {
+    std::unique_lock<std::mutex> lock(mutex);
+    menu = &to_menu;
+    jobs = to_jobs;
+    scale = to_scale;
+    desc = to_desc;
+    next_job = 0;
+    finished = 0;
+    drawn = 0;
+    ++batch;
+    lock.unlock();
+    wake.notify_all();
+
+    lock.lock();
+    while (next_job < jobs.size()) {
+        RasterJob job = jobs[next_job++];
+        lock.unlock();
+        size_t bytes;
+        {
+            TraceScope span("render");
+            bytes = update_panel_raster(to_menu, to_menu.panels[job.panel], job.hovered, to_scale);
+        }
+        lock.lock();
+        drawn += bytes;
+        ++finished;
+    }
+    done.wait(lock, [&] { return finished == jobs.size(); });
+    return drawn;
+}
+
+RasterAhead::RasterAhead() {
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe2");
+        exit(1);
+    }
+    thread = std::thread(&RasterAhead::work, this);
+}
+
+RasterAhead::~RasterAhead() {
+    cancel();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+    }
+    wake.notify_one();
+    thread.join();
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+void RasterAhead::work() {
+    WorkerText text;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return quitting || (job && !running && !raster); });
+        if (quitting) break;
+        running = true;
+        lock.unlock();
+        cairo_surface_t *drawn;
+        {
+            TraceScope span("render ahead");
+            text.prepare(scale, desc);
+            drawn = draw_panel_raster(*menu, *job, scale, text.layout, stop);
+        }
+        lock.lock();
+        running = false;
+        raster = drawn;
+        job = nullptr;
+        done.notify_one();
+        // A full pipe is readable already
+        if (drawn) {
+            ssize_t written = write(wake_pipe[1], "", 1);
+            (void)written;
+        }
+    }
+}
+
+void RasterAhead::drain() {
+    char bytes[16];
+    while (read(wake_pipe[0], bytes, sizeof(bytes)) > 0) {}
+}
+
+void RasterAhead::start(const Menu& to_menu, int to_panel, double to_scale,
+                        const PangoFontDescription *to_desc) {
+    cancel();
+    panel = to_panel;
+    stop = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        menu = &to_menu;
+        job = &to_menu.panels[to_panel];
+        scale = to_scale;
+        desc = to_desc;
+    }
+    wake.notify_one();
+}
+
+size_t RasterAhead::take(Menu& to_menu) {
+    if (panel < 0) return 0;
+    cairo_surface_t *drawn;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job || running || !raster) return 0;
+        drawn = raster;
+        raster = nullptr;
+    }
+    drain();
+    MenuPanel& mp = to_menu.panels[panel];
+    if (mp.raster) cairo_surface_destroy(mp.raster);
+    mp.raster = drawn;
+    mp.raster_hovered = -1;
+    mp.raster_scale = scale;
+    panel = -1;
+    return (size_t)cairo_image_surface_get_stride(drawn) * cairo_image_surface_get_height(drawn);
+}
+
+bool RasterAhead::wait(double ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return done.wait_for(lock, std::chrono::duration<double, std::milli>(ms),
+                         [&] { return !job && !running; });
+}
+
+void RasterAhead::cancel() {
+    if (panel < 0) return;
+    stop = true;
+    std::unique_lock<std::mutex> lock(mutex);
+    // A job the worker has not picked up yet is simply withdrawn
+    job = nullptr;
+    done.wait(lock, [&] { return !running; });
+    if (raster) cairo_surface_destroy(raster);
+    raster = nullptr;
+    lock.unlock();
+    drain();
+    panel = -1;
+}
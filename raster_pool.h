@@ -0,0 +1,108 @@
+#pragma once
+
+extern "C" {
+#include <pango/pangocairo.h>
+#include <stdint.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "menu.h"
+
+// One panel to bring up to date, with the item to light
+struct RasterJob {
+    int panel;
+    int hovered;
+};
+
+// Draws panel rasters on worker threads, so a frame with several panels to
+// draw from scratch takes about as long as the largest of them rather than
+// all of them. Pango contexts are not to be shared between threads, so each
+// worker has its own font map and context and sets the labels it draws into
+// a layout of its own; the calling thread takes jobs too, with the menu's
+// layouts. The menu must not change while update() runs.
+class RasterPool {
+  public:
+    explicit RasterPool(size_t threads);
+    ~RasterPool();
+    RasterPool(const RasterPool&) = delete;
+    RasterPool& operator=(const RasterPool&) = delete;
+
+    // As update_panel_raster for every job, returning once all are done
+    // with the bytes drawn in all
+    size_t update(Menu& menu, const std::vector<RasterJob>& jobs, double scale,
+                  const PangoFontDescription *desc);
+
+    // Workers worth starting on this machine, leaving a core to the caller
+    static size_t default_threads();
+
+  private:
+    void work();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+
+    // The batch being drawn, guarded by mutex
+    uint64_t batch = 0;
+    Menu *menu = nullptr;
+    std::vector<RasterJob> jobs;
+    double scale = 1;
+    const PangoFontDescription *desc = nullptr;
+    size_t next_job = 0;
+    size_t finished = 0;
+    size_t drawn = 0;
+};
+
+// Draws one panel raster at a time ahead of need, on a thread of its own
+// with its own font map and context, while the menu waits for input. The
+// result goes to the panel only once taken on the menu's thread. The menu
+// must not change while a job runs, so it is cancelled before any input is
+// handled; the worker then stops within a band of rows.
+class RasterAhead {
+  public:
+    RasterAhead();
+    ~RasterAhead();
+    RasterAhead(const RasterAhead&) = delete;
+    RasterAhead& operator=(const RasterAhead&) = delete;
+
+    // Readable once a job is done, to be polled along with the input
+    int fd() const { return wake_pipe[0]; }
+    bool busy() const { return panel >= 0; }
+
+    // Draw `panel` with nothing lit, at `scale`
+    void start(const Menu& menu, int panel, double scale, const PangoFontDescription *desc);
+    // Hand a finished raster to its panel. Returns the bytes drawn, or 0
+    // while the job is still running.
+    size_t take(Menu& menu);
+    // Wait up to `ms` for the job to finish. Returns whether it did.
+    bool wait(double ms);
+    // Give the job up, waiting until the worker has let go of the menu
+    void cancel();
+
+  private:
+    void work();
+    void drain();
+
+    std::thread thread;
+    int wake_pipe[2];
+    std::atomic<bool> stop{false};
+    int panel = -1; // the job, owned by the menu's thread
+
+    // Guarded by mutex
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool quitting = false;
+    bool running = false;
+    const Menu *menu = nullptr;
+    const MenuPanel *job = nullptr;
+    double scale = 1;
+    const PangoFontDescription *desc = nullptr;
+    cairo_surface_t *raster = nullptr;
+};
@@ -0,0 +1,202 @@
+extern "C" {
+#include <wayland-client.h>
+#include <stdarg.h>
+#include <stdlib.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include "replay.h"
+
+// Every object rmenu creates is one of these. rmenu only ever hands them
+// back to the functions below, so they need not be real wl_proxy objects.
+struct ReplayProxy {
+    const struct wl_interface *interface;
+    void (**listener)(void);
+    void *data;
+    // For surfaces: the buffer attached for the next commit, and the one
+    // the last commit showed
+    ReplayProxy *pending = nullptr;
+    bool attached = false;
+    ReplayProxy *shown = nullptr;
+    // For buffers
+    int width = 0;
+    int height = 0;
+};
+
+static ReplayProxy *root;
+static std::vector<ReplayProxy *> frame_callbacks;
+static std::vector<ReplayProxy *> releases;
+static std::vector<ReplayCommit> commits;
+static size_t damaged_bytes;
+static std::atomic<size_t> allocations;
+
+// Array and nothrow forms end up here too
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+size_t replay_allocations() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+struct wl_proxy *replay_create_proxy(const struct wl_interface *interface) {
+    ReplayProxy *proxy = new ReplayProxy();
+    proxy->interface = interface;
+    return reinterpret_cast<struct wl_proxy *>(proxy);
+}
+
+void replay_set_root(struct wl_surface *surface) {
+    root = reinterpret_cast<ReplayProxy *>(surface);
+}
+
+const std::vector<ReplayCommit>& replay_commits() {
+    return commits;
+}
+
+// What a compositor does when the display refreshes: buffers it let go of
+// are released, then the surfaces that asked are told to draw the next frame
+void replay_vblank(uint32_t time) {
+    std::vector<ReplayProxy *> released;
+    released.swap(releases);
+    for (ReplayProxy *buffer : released) {
+        auto release = reinterpret_cast<void (*)(void *, struct wl_buffer *)>(buffer->listener[0]);
+        release(buffer->data, reinterpret_cast<struct wl_buffer *>(buffer));
+    }
+    std::vector<ReplayProxy *> callbacks;
+    callbacks.swap(frame_callbacks);
+    for (ReplayProxy *callback : callbacks) {
+        auto done = reinterpret_cast<void (*)(void *, struct wl_callback *, uint32_t)>(callback->listener[0]);
+        done(callback->data, reinterpret_cast<struct wl_callback *>(callback), time);
+    }
+}
+
+static void surface_commit(ReplayProxy *surface) {
+    if (surface->attached) {
+        // The buffer shown until now is free once the new one is on screen
+        if (surface->shown && surface->shown != surface->pending && surface->shown->listener)
+            releases.push_back(surface->shown);
+        surface->shown = surface->pending;
+        surface->attached = false;
+    }
+    if (surface == root) {
+        commits.push_back({ damaged_bytes });
+        damaged_bytes = 0;
+    }
+}
+
+// The one place every request goes through
+static struct wl_proxy *marshal(struct wl_proxy *target, uint32_t opcode,
+                                const struct wl_interface *interface, va_list args) {
+    ReplayProxy *proxy = reinterpret_cast<ReplayProxy *>(target);
+    ReplayProxy *created = interface
+        ? reinterpret_cast<ReplayProxy *>(replay_create_proxy(interface)) : nullptr;
+
+    if (proxy->interface == &wl_surface_interface) {
+        switch (opcode) {
+        case WL_SURFACE_ATTACH:
+            proxy->pending = static_cast<ReplayProxy *>(va_arg(args, void *));
+            proxy->attached = true;
+            break;
+        case WL_SURFACE_DAMAGE_BUFFER: {
+            va_arg(args, int32_t);
+            va_arg(args, int32_t);
+            int32_t w = va_arg(args, int32_t);
+            int32_t h = va_arg(args, int32_t);
+            // Damage may be given as "everything"
+            if (proxy->pending && proxy->pending->width) {
+                w = std::min(w, proxy->pending->width);
+                h = std::min(h, proxy->pending->height);
+            }
+            damaged_bytes += (size_t)w * h * 4;
+            break;
+        }
+        case WL_SURFACE_FRAME:
+            frame_callbacks.push_back(created);
+            break;
+        case WL_SURFACE_COMMIT:
+            surface_commit(proxy);
+            break;
+        }
+    } else if (proxy->interface == &wl_shm_pool_interface && opcode == WL_SHM_POOL_CREATE_BUFFER) {
+        va_arg(args, void *); // the new id
+        va_arg(args, int32_t); // offset
+        created->width = va_arg(args, int32_t);
+        created->height = va_arg(args, int32_t);
+    }
+    return reinterpret_cast<struct wl_proxy *>(created);
+}
+
+extern "C" {
+
+void wl_proxy_destroy(struct wl_proxy *target) {
+    ReplayProxy *proxy = reinterpret_cast<ReplayProxy *>(target);
+    frame_callbacks.erase(std::remove(frame_callbacks.begin(), frame_callbacks.end(), proxy),
+                          frame_callbacks.end());
+    releases.erase(std::remove(releases.begin(), releases.end(), proxy), releases.end());
+    if (proxy == root) root = nullptr;
+    delete proxy;
+}
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode,
+                                        const struct wl_interface *interface,
+                                        uint32_t version, uint32_t flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    struct wl_proxy *created = marshal(proxy, opcode, interface, args);
+    va_end(args);
+    if (flags & WL_MARSHAL_FLAG_DESTROY) wl_proxy_destroy(proxy);
+    return created;
+}
+
+// Older wayland-scanner output marshals through these instead
+void wl_proxy_marshal(struct wl_proxy *proxy, uint32_t opcode, ...) {
+    va_list args;
+    va_start(args, opcode);
+    marshal(proxy, opcode, nullptr, args);
+    va_end(args);
+}
+
+struct wl_proxy *wl_proxy_marshal_constructor(struct wl_proxy *proxy, uint32_t opcode,
+                                              const struct wl_interface *interface, ...) {
+    va_list args;
+    va_start(args, interface);
+    struct wl_proxy *created = marshal(proxy, opcode, interface, args);
+    va_end(args);
+    return created;
+}
+
+struct wl_proxy *wl_proxy_marshal_constructor_versioned(struct wl_proxy *proxy, uint32_t opcode,
+                                                        const struct wl_interface *interface,
+                                                        uint32_t version, ...) {
+    va_list args;
+    va_start(args, version);
+    struct wl_proxy *created = marshal(proxy, opcode, interface, args);
+    va_end(args);
+    return created;
+}
+
+int wl_proxy_add_listener(struct wl_proxy *target, void (**implementation)(void), void *data) {
+    ReplayProxy *proxy = reinterpret_cast<ReplayProxy *>(target);
+    proxy->listener = implementation;
+    proxy->data = data;
+    return 0;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy *) {
+    return 1;
+}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+extern "C" {
+#include <wayland-client.h>
+#include <stddef.h>
+#include <stdint.h>
+}
+
+#include <vector>
+
+// Headless stand-in for the compositor, used by rmenu-replay. It takes the
+// place of libwayland's proxy layer: requests are not sent anywhere, but
+// commits and damage are counted, and buffer releases and frame callbacks
+// are delivered when replay_vblank() says the display refreshed.
+
+// One commit of the root surface, and with it of the whole menu
+struct ReplayCommit {
+    size_t damaged_bytes; // buffer area damaged on every surface since the last
+};
+
+struct wl_proxy *replay_create_proxy(const struct wl_interface *interface);
+void replay_set_root(struct wl_surface *surface);
+const std::vector<ReplayCommit>& replay_commits();
+void replay_vblank(uint32_t time);
+
+// Calls to operator new so far. rmenu-replay counts them, to check that
+// pointer handling does not allocate.
+size_t replay_allocations();
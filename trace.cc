@@ -0,0 +1,77 @@
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+}
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+bool trace_enabled = false;
+
+struct TraceSpan {
+    const char *name;
+    double start_us;
+    double dur_us;
+    int tid;
+};
+
+static const char *trace_path;
+static std::mutex trace_mutex;
+static std::vector<TraceSpan> trace_spans;
+
+// Small thread numbers in order of first span; the main thread traces first
+static std::atomic<int> next_tid;
+static thread_local int trace_tid = 0;
+
+void trace_init() {
+    trace_path = getenv("RMENU_TRACE");
+    if (!trace_path || !*trace_path) return;
+    trace_enabled = true;
+    trace_spans.reserve(4096);
+    atexit(trace_write);
+}
+
+double trace_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void trace_span(const char *name, double start_us, double end_us) {
+    if (!trace_tid) trace_tid = ++next_tid;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_spans.push_back({ name, start_us, end_us - start_us, trace_tid });
+}
+
+// Writes everything traced so far, replacing the file. Called at exit, and
+// by the daemon after every menu, as it does not exit on its own.
+void trace_write() {
+    if (!trace_enabled) return;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    FILE *f = fopen(trace_path, "w");
+    if (!f) {
+        perror(trace_path);
+        return;
+    }
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rmenu\"}}", pid);
+    for (const TraceSpan& ev : trace_spans) {
+        fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+                ev.name, ev.start_us, ev.dur_us, pid, ev.tid);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+// Drops the spans already written, so a daemon that serves menus for days
+// keeps and rewrites only those of the menu it has just shown
+void trace_clear() {
+    if (!trace_enabled) return;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_spans.clear();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// Opt-in tracing of where startup and frame time goes. With RMENU_TRACE
+// set to a file name, spans are kept in memory and written to it as Chrome
+// trace-event JSON, which chrome://tracing and ui.perfetto.dev open. When
+// it is not set, a span costs a branch on trace_enabled.
+
+extern bool trace_enabled;
+
+void trace_init();
+double trace_now_us();
+void trace_span(const char *name, double start_us, double end_us);
+void trace_write();
+void trace_clear();
+
+// Times the enclosing scope. `name` must outlive the process, as names are
+// only written out at the end.
+class TraceScope {
+  public:
+    explicit TraceScope(const char *name) : name(trace_enabled ? name : nullptr) {
+        if (this->name) start = trace_now_us();
+    }
+    ~TraceScope() {
+        if (name) trace_span(name, start, trace_now_us());
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+  private:
+    const char *name;
+    double start = 0;
+};